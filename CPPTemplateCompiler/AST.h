@@ -16,6 +16,9 @@ namespace cpptemplate {
 	class ConditionNode;
 	class BlockCallNode;
 	class BlockParentCallNode;
+	class TranslationNode;
+	class LetNode;
+	class StaticNode;
 	class Block;
 	class AST;
 	class BaseTemplateAST;
@@ -30,6 +33,9 @@ namespace cpptemplate {
 	typedef std::shared_ptr<ConditionNode> ConditionNodePtr;
 	typedef std::shared_ptr<BlockCallNode> BlockCallNodePtr;
 	typedef std::shared_ptr<BlockParentCallNode> BlockParentCallNodePtr;
+	typedef std::shared_ptr<TranslationNode> TranslationNodePtr;
+	typedef std::shared_ptr<LetNode> LetNodePtr;
+	typedef std::shared_ptr<StaticNode> StaticNodePtr;
 	typedef std::shared_ptr<Block> BlockPtr;
 	typedef std::shared_ptr<AST> ASTPtr;
 	typedef std::shared_ptr<BaseTemplateAST> BaseTemplateASTPtr;
@@ -65,15 +71,25 @@ namespace cpptemplate {
 		void set_name(std::string s) { name = std::move(s); }
 		const std::string& get_type() const { return type; }
 		void set_type(std::string s) { type = std::move(s); }
+		// lazy<T> and async<T> params are only evaluated once rendering first uses them
+		bool is_deferred() const {
+			auto start = type.find_first_not_of(" \t");
+			if(start == std::string::npos) return false;
+			return type.compare(start, 5, "lazy<") == 0 || type.compare(start, 6, "async<") == 0;
+		}
 	};
 	class CodeBlock {
 		std::string name {};
 		std::string code {};
+		// Template line the code starts on, 0 if unknown
+		size_t source_line {0};
 	public:
 		const std::string& get_name() const { return name; }
 		void set_name(std::string s) { name = std::move(s); }
 		const std::string& get_code() const { return code; }
 		void set_code(std::string s) { code = std::move(s); }
+		size_t get_source_line() const { return source_line; }
+		void set_source_line(size_t l) { source_line = l; }
 	};
 	enum class NodeType {
 		AppendString,
@@ -81,12 +97,21 @@ namespace cpptemplate {
 		Expression,
 		Conditional,
 		BlockCall,
-		BlockParentCall
+		BlockParentCall,
+		Translation,
+		Let,
+		Static
 	};
 	class Node {
+		size_t source_line {0};
+		size_t source_col {0};
 	public:
 		virtual NodeType get_type() const = 0;
 		virtual ~Node() {}
+
+		size_t get_source_line() const { return source_line; }
+		size_t get_source_col() const { return source_col; }
+		void set_source_location(size_t line, size_t col) { source_line = line; source_col = col; }
 	};
 	class AppendStringNode: public Node {
 		std::string data {};
@@ -101,23 +126,33 @@ namespace cpptemplate {
 		std::string source {};
 		std::string varname {};
 		std::vector<NodePtr> nodes {};
+		bool parallel {false};
+		size_t grain {64};
 	public:
 		NodeType get_type() const override { return NodeType::ForEachLoop; }
 		const std::string& get_source() const { return source; }
 		void set_source(std::string d) { source = std::move(d); }
 		const std::string& get_variable_name() const { return varname; }
 		void set_variable_name(std::string d) { varname = std::move(d); }
+		bool is_parallel() const { return parallel; }
+		void set_parallel(bool p) { parallel = p; }
+		size_t get_grain() const { return grain; }
+		void set_grain(size_t g) { grain = g; }
 		const std::vector<NodePtr> get_nodes() const { return nodes; }
 		void set_nodes(std::vector<NodePtr> n) { nodes = std::move(n); }
 	};
 	class ExpressionNode: public Node {
 		std::string code {};
+		bool pure {false};
 	public:
 		ExpressionNode() {}
 		ExpressionNode(std::string c) : code(std::move(c)) {}
 		NodeType get_type() const override { return NodeType::Expression; }
 		const std::string& get_code() const { return code; }
 		void set_code(std::string d) { code = std::move(d); }
+		// Marked by the template as free of side effects, so it may be evaluated once for several uses or ahead of a loop
+		bool is_pure() const { return pure; }
+		void set_pure(bool p) { pure = p; }
 	};
 	class ConditionNode: public Node {
 		std::vector<std::pair<std::string, std::vector<NodePtr>>> branches {};
@@ -147,12 +182,54 @@ namespace cpptemplate {
 		void set_block(std::string b) { block = b; }
 		const std::string& get_block() const { return block; }
 	};
+	class TranslationNode: public Node {
+		std::string key {};
+	public:
+		TranslationNode() {}
+		TranslationNode(std::string k) : key(std::move(k)) {}
+		NodeType get_type() const override { return NodeType::Translation; }
+		void set_key(std::string k) { key = std::move(k); }
+		const std::string& get_key() const { return key; }
+	};
+	// Binds name to the value of code for the nodes that follow it in the same scope, which are its children
+	class LetNode: public Node {
+		std::string name {};
+		std::string code {};
+		std::vector<NodePtr> nodes {};
+	public:
+		LetNode() {}
+		LetNode(std::string n, std::string c) : name(std::move(n)), code(std::move(c)) {}
+		NodeType get_type() const override { return NodeType::Let; }
+		const std::string& get_name() const { return name; }
+		void set_name(std::string n) { name = std::move(n); }
+		const std::string& get_code() const { return code; }
+		void set_code(std::string c) { code = std::move(c); }
+		const std::vector<NodePtr>& get_nodes() const { return nodes; }
+		void set_nodes(std::vector<NodePtr> n) { nodes = std::move(n); }
+	};
+	// Rendered once when the template is constructed and whenever a variable is set, render appends the stored text.
+	// Sections are numbered per template, those in the base body first and then those of its blocks.
+	class StaticNode: public Node {
+		size_t index {0};
+		std::vector<NodePtr> nodes {};
+	public:
+		StaticNode() {}
+		explicit StaticNode(size_t i) : index(i) {}
+		NodeType get_type() const override { return NodeType::Static; }
+		size_t get_index() const { return index; }
+		void set_index(size_t i) { index = i; }
+		const std::vector<NodePtr>& get_nodes() const { return nodes; }
+		void set_nodes(std::vector<NodePtr> n) { nodes = std::move(n); }
+	};
 	class Block {
 		std::string name {};
 		std::vector<NodePtr> nodes {};
+		bool parallel {false};
 	public:
 		const std::string& get_name() const { return name; }
 		void set_name(std::string n) { name = std::move(n); }
+		bool is_parallel() const { return parallel; }
+		void set_parallel(bool p) { parallel = p; }
 		void add_node(NodePtr node) { nodes.push_back(node); }
 		const std::vector<NodePtr> get_nodes() const { return nodes; }
 		void set_nodes(std::vector<NodePtr> n) { nodes = n;}
@@ -182,6 +259,11 @@ namespace cpptemplate {
 				if(c->get_name() == id) return c;
 			return nullptr;
 		}
+		BlockPtr get_block(const std::string& name) const {
+			for(auto& b : blocks)
+				if(b->get_name() == name) return b;
+			return nullptr;
+		}
 		const std::set<std::string>& get_header_includes() const { return header_includes; }
 		const std::set<std::string>& get_implementation_includes() const { return impl_includes; }
 		void set_variables(std::vector<VariablePtr> vars) { variables = std::move(vars); }
@@ -0,0 +1,381 @@
+#include "ASTCache.h"
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <process.h>
+#endif
+
+namespace cpptemplate {
+	static const char MAGIC[8] = { 'C', 'T', 'P', 'L', 'A', 'S', 'T', '\0' };
+
+	namespace {
+		class Writer {
+			std::ostream& str;
+		public:
+			explicit Writer(std::ostream& s) : str(s) {}
+
+			void number(uint64_t v) {
+				// LEB128, most values in an AST are tiny
+				do {
+					uint8_t b = v & 0x7f;
+					v >>= 7;
+					if(v) b |= 0x80;
+					str.put(static_cast<char>(b));
+				} while(v);
+			}
+			void string(const std::string& s) {
+				number(s.size());
+				str.write(s.data(), s.size());
+			}
+			void nodes(const std::vector<NodePtr>& list) {
+				number(list.size());
+				for(auto& n : list) node(n);
+			}
+			void node(NodePtr n) {
+				number(static_cast<uint64_t>(n->get_type()));
+				number(n->get_source_line());
+				number(n->get_source_col());
+				switch(n->get_type()) {
+					case NodeType::AppendString:
+						string(std::dynamic_pointer_cast<AppendStringNode>(n)->get_data());
+						break;
+					case NodeType::Expression:
+						string(std::dynamic_pointer_cast<ExpressionNode>(n)->get_code());
+						number(std::dynamic_pointer_cast<ExpressionNode>(n)->is_pure());
+						break;
+					case NodeType::BlockCall:
+						string(std::dynamic_pointer_cast<BlockCallNode>(n)->get_block());
+						break;
+					case NodeType::BlockParentCall:
+						string(std::dynamic_pointer_cast<BlockParentCallNode>(n)->get_block());
+						break;
+					case NodeType::Translation:
+						string(std::dynamic_pointer_cast<TranslationNode>(n)->get_key());
+						break;
+					case NodeType::ForEachLoop: {
+						auto l = std::dynamic_pointer_cast<ForEachLoopNode>(n);
+						string(l->get_variable_name());
+						string(l->get_source());
+						number(l->is_parallel());
+						number(l->get_grain());
+						nodes(l->get_nodes());
+						break;
+					}
+					case NodeType::Conditional: {
+						auto c = std::dynamic_pointer_cast<ConditionNode>(n);
+						number(c->get_branches().size());
+						for(auto& b : c->get_branches()) {
+							string(b.first);
+							nodes(b.second);
+						}
+						nodes(c->get_else_branch());
+						break;
+					}
+					case NodeType::Let: {
+						auto l = std::dynamic_pointer_cast<LetNode>(n);
+						string(l->get_name());
+						string(l->get_code());
+						nodes(l->get_nodes());
+						break;
+					}
+					case NodeType::Static: {
+						auto s = std::dynamic_pointer_cast<StaticNode>(n);
+						number(s->get_index());
+						nodes(s->get_nodes());
+						break;
+					}
+				}
+			}
+		};
+
+		class Reader {
+			const char* pos;
+			const char* end;
+		public:
+			Reader(const char* data, size_t len) : pos(data), end(data + len) {}
+
+			void expect(size_t n) {
+				if(static_cast<size_t>(end - pos) < n) throw std::runtime_error("truncated AST cache entry");
+			}
+			uint64_t number() {
+				uint64_t v = 0;
+				for(unsigned shift = 0; shift < 64; shift += 7) {
+					expect(1);
+					uint8_t b = static_cast<uint8_t>(*pos++);
+					v |= static_cast<uint64_t>(b & 0x7f) << shift;
+					if(!(b & 0x80)) return v;
+				}
+				throw std::runtime_error("invalid number in AST cache entry");
+			}
+			std::string string() {
+				auto len = number();
+				expect(len);
+				std::string res(pos, len);
+				pos += len;
+				return res;
+			}
+			std::vector<NodePtr> nodes() {
+				std::vector<NodePtr> res;
+				auto cnt = number();
+				for(uint64_t i = 0; i < cnt; i++) res.push_back(node());
+				return res;
+			}
+			NodePtr node() {
+				auto type = static_cast<NodeType>(number());
+				auto line = number();
+				auto col = number();
+				NodePtr ptr;
+				switch(type) {
+					case NodeType::AppendString: ptr = std::make_shared<AppendStringNode>(string()); break;
+					case NodeType::Expression: {
+						auto n = std::make_shared<ExpressionNode>(string());
+						n->set_pure(number() != 0);
+						ptr = n;
+						break;
+					}
+					case NodeType::BlockCall: {
+						auto n = std::make_shared<BlockCallNode>();
+						n->set_block(string());
+						ptr = n;
+						break;
+					}
+					case NodeType::BlockParentCall: ptr = std::make_shared<BlockParentCallNode>(string()); break;
+					case NodeType::Translation: ptr = std::make_shared<TranslationNode>(string()); break;
+					case NodeType::ForEachLoop: {
+						auto n = std::make_shared<ForEachLoopNode>();
+						n->set_variable_name(string());
+						n->set_source(string());
+						n->set_parallel(number() != 0);
+						n->set_grain(number());
+						n->set_nodes(nodes());
+						ptr = n;
+						break;
+					}
+					case NodeType::Conditional: {
+						auto n = std::make_shared<ConditionNode>();
+						auto cnt = number();
+						for(uint64_t i = 0; i < cnt; i++) {
+							auto cond = string();
+							n->add_branch(cond, nodes());
+						}
+						n->set_else(nodes());
+						ptr = n;
+						break;
+					}
+					case NodeType::Let: {
+						auto n = std::make_shared<LetNode>();
+						n->set_name(string());
+						n->set_code(string());
+						n->set_nodes(nodes());
+						ptr = n;
+						break;
+					}
+					case NodeType::Static: {
+						auto n = std::make_shared<StaticNode>(number());
+						n->set_nodes(nodes());
+						ptr = n;
+						break;
+					}
+					default:
+						throw std::runtime_error("invalid node type in AST cache entry");
+				}
+				ptr->set_source_location(line, col);
+				return ptr;
+			}
+		};
+	}
+
+	uint64_t ASTCache::Hash(const std::string& fname, const std::string& content) {
+		// FNV-1a over version, path and content
+		uint64_t h = 0xcbf29ce484222325ull;
+		auto feed = [&h](const char* data, size_t len) {
+			for(size_t i = 0; i < len; i++) {
+				h ^= static_cast<uint8_t>(data[i]);
+				h *= 0x100000001b3ull;
+			}
+		};
+		uint32_t version = VERSION;
+		feed(reinterpret_cast<const char*>(&version), sizeof(version));
+		feed(fname.c_str(), fname.size() + 1);
+		feed(content.data(), content.size());
+		return h;
+	}
+
+	void ASTCache::Serialize(std::ostream& str, ASTPtr ast) {
+		Writer w(str);
+		str.write(MAGIC, sizeof(MAGIC));
+		w.number(VERSION);
+		w.number(ast->is_base_ast());
+		w.string(ast->get_filename());
+		w.string(ast->get_classname());
+		w.string(ast->get_namespace());
+		w.number(ast->get_header_includes().size());
+		for(auto& i : ast->get_header_includes()) w.string(i);
+		w.number(ast->get_implementation_includes().size());
+		for(auto& i : ast->get_implementation_includes()) w.string(i);
+		w.number(ast->get_codeblocks().size());
+		for(auto& c : ast->get_codeblocks()) {
+			w.string(c->get_name());
+			w.string(c->get_code());
+			w.number(c->get_source_line());
+		}
+		w.number(ast->get_variables().size());
+		for(auto& v : ast->get_variables()) {
+			w.string(v->get_name());
+			w.string(v->get_function_name());
+			w.string(v->get_type());
+		}
+		w.number(ast->get_parameters().size());
+		for(auto& p : ast->get_parameters()) {
+			w.string(p->get_name());
+			w.string(p->get_type());
+		}
+		w.number(ast->get_blocks().size());
+		for(auto& b : ast->get_blocks()) {
+			w.string(b->get_name());
+			w.number(b->is_parallel());
+			w.nodes(b->get_nodes());
+		}
+		if(ast->is_base_ast()) {
+			w.nodes(std::dynamic_pointer_cast<BaseTemplateAST>(ast)->get_nodes());
+		} else {
+			w.string(std::dynamic_pointer_cast<ExtendingTemplateAST>(ast)->get_base_template());
+		}
+	}
+
+	ASTPtr ASTCache::Deserialize(const char* data, size_t len, const ASTLoader& loader) {
+		if(len < sizeof(MAGIC) || memcmp(data, MAGIC, sizeof(MAGIC)) != 0)
+			throw std::runtime_error("not an AST cache entry");
+		Reader r(data + sizeof(MAGIC), len - sizeof(MAGIC));
+		if(r.number() != VERSION)
+			throw std::runtime_error("unsupported AST cache version");
+		ASTPtr ast;
+		if(r.number()) ast = std::make_shared<BaseTemplateAST>();
+		else ast = std::make_shared<ExtendingTemplateAST>();
+		ast->set_filename(r.string());
+		ast->set_classname(r.string());
+		ast->set_namespace(r.string());
+		for(auto cnt = r.number(); cnt > 0; cnt--) ast->add_header_include(r.string());
+		for(auto cnt = r.number(); cnt > 0; cnt--) ast->add_implementation_include(r.string());
+		for(auto cnt = r.number(); cnt > 0; cnt--) {
+			auto code = std::make_shared<CodeBlock>();
+			code->set_name(r.string());
+			code->set_code(r.string());
+			code->set_source_line(r.number());
+			ast->add_codeblock(code);
+		}
+		for(auto cnt = r.number(); cnt > 0; cnt--) {
+			auto name = r.string();
+			auto fname = r.string();
+			ast->add_variable(std::make_shared<Variable>(name, fname, r.string()));
+		}
+		for(auto cnt = r.number(); cnt > 0; cnt--) {
+			auto name = r.string();
+			ast->add_parameter(std::make_shared<Parameter>(name, r.string()));
+		}
+		for(auto cnt = r.number(); cnt > 0; cnt--) {
+			auto block = std::make_shared<Block>();
+			block->set_name(r.string());
+			block->set_parallel(r.number() != 0);
+			block->set_nodes(r.nodes());
+			ast->add_block(block);
+		}
+		if(ast->is_base_ast()) {
+			std::dynamic_pointer_cast<BaseTemplateAST>(ast)->set_nodes(r.nodes());
+		} else {
+			auto ext = std::dynamic_pointer_cast<ExtendingTemplateAST>(ast);
+			ext->set_base_template(r.string());
+			auto extname = Parser::ResolveBaseTemplate(ast->get_filename(), ext->get_base_template());
+			ext->set_base_template_ast(loader ? loader(extname) : Parser::ParseFile(extname));
+		}
+		return ast;
+	}
+
+	ASTPtr ASTCache::LoadEntry(const std::string& path, const ASTLoader& loader) {
+#if defined(__unix__) || defined(__APPLE__)
+		int fd = open(path.c_str(), O_RDONLY);
+		if(fd < 0) return nullptr;
+		struct stat st;
+		if(fstat(fd, &st) != 0 || st.st_size == 0) {
+			close(fd);
+			return nullptr;
+		}
+		void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if(data == MAP_FAILED) return nullptr;
+		// A truncated or corrupt entry is a miss, parsing again replaces it.
+		// Errors of the base template come back when the template is parsed.
+		ASTPtr ast;
+		try {
+			ast = Deserialize(static_cast<const char*>(data), st.st_size, loader);
+		} catch(const std::exception&) {
+			ast = nullptr;
+		}
+		munmap(data, st.st_size);
+		return ast;
+#else
+		std::ifstream str(path, std::ios::binary);
+		if(!str) return nullptr;
+		std::ostringstream ss;
+		ss << str.rdbuf();
+		auto data = ss.str();
+		try {
+			return Deserialize(data.data(), data.size(), loader);
+		} catch(const std::exception&) {
+			return nullptr;
+		}
+#endif
+	}
+
+	void ASTCache::StoreEntry(const std::string& path, ASTPtr ast) {
+		// Write to a temporary of this process and rename, concurrent builds never see a partial entry
+#if defined(__unix__) || defined(__APPLE__)
+		auto tmp = path + ".tmp" + std::to_string(getpid());
+#else
+		auto tmp = path + ".tmp" + std::to_string(_getpid());
+#endif
+		{
+			std::ofstream str(tmp, std::ios::binary);
+			if(!str) return; // The cache is an optimization, a read-only cache dir is not an error
+			Serialize(str, ast);
+			if(!str) {
+				str.close();
+				std::remove(tmp.c_str());
+				return;
+			}
+		}
+		// Windows does not rename over an existing file, a corrupt entry has to go first
+		if(std::rename(tmp.c_str(), path.c_str()) != 0) {
+			std::remove(path.c_str());
+			if(std::rename(tmp.c_str(), path.c_str()) != 0)
+				std::remove(tmp.c_str());
+		}
+	}
+
+	ASTPtr ASTCache::ParseFile(const std::string& fname, const std::string& directory) {
+		std::ifstream str(fname, std::ios::binary);
+		if(!str) throw std::runtime_error("failed to open file");
+		std::ostringstream ss;
+		ss << str.rdbuf();
+		auto content = ss.str();
+
+		char key[17];
+		snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(Hash(fname, content)));
+		auto path = directory + "/" + key + ".ast";
+		ASTLoader loader = [directory](const std::string& base) { return ParseFile(base, directory); };
+
+		auto ast = LoadEntry(path, loader);
+		if(ast) return ast;
+
+		std::istringstream is(content);
+		ast = Parser::ParseStream(is, fname, loader);
+		StoreEntry(path, ast);
+		return ast;
+	}
+}
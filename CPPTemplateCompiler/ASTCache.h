@@ -0,0 +1,23 @@
+#pragma once
+#include "AST.h"
+#include "Parser.h"
+#include <cstdint>
+
+namespace cpptemplate {
+	// Stores parsed templates in a versioned binary format inside a cache directory.
+	// Entries are keyed by a hash of the template path and content, so changed
+	// templates simply miss and stale entries are never read.
+	class ASTCache {
+		static uint64_t Hash(const std::string& fname, const std::string& content);
+		static ASTPtr LoadEntry(const std::string& path, const ASTLoader& loader);
+		static void StoreEntry(const std::string& path, ASTPtr ast);
+	public:
+		// Bump whenever the serialized layout or the AST itself changes
+		static const uint32_t VERSION = 5;
+
+		static ASTPtr ParseFile(const std::string& fname, const std::string& directory);
+
+		static void Serialize(std::ostream& str, ASTPtr ast);
+		static ASTPtr Deserialize(const char* data, size_t len, const ASTLoader& loader);
+	};
+}
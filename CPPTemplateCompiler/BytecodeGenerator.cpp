@@ -0,0 +1,677 @@
+#include "BytecodeGenerator.h"
+#include "Generator.h"
+#include "StringHelper.h"
+#include <cstring>
+#include <map>
+#include <set>
+#include <sstream>
+
+namespace cpptemplate {
+	static const char MAGIC[8] = { 'C', 'T', 'P', 'L', 'B', 'C', '\0', '\0' };
+	// Magic, version, binding hash, code size, block count, literal size
+	static const size_t HEADER_SIZE = 32;
+
+	namespace {
+		struct LoopScope {
+			std::string variable;
+			// Type of the value the slot of the variable points to
+			std::string type;
+		};
+
+		// Accessor bodies by their code, std::map keeps them sorted so indices
+		// only depend on the set of accessors and not on their order in the template
+		typedef std::map<std::string, uint32_t> AccessorTable;
+
+		class Program {
+			struct Fixup {
+				size_t pos;
+				AccessorTable* table;
+				std::string body;
+			};
+
+			// Most derived template first
+			std::vector<ASTPtr> levels {};
+			std::map<std::string, uint32_t> literal_offsets {};
+			std::map<std::pair<size_t, std::string>, uint32_t> block_ids {};
+			std::vector<std::pair<size_t, std::string>> block_queue {};
+			std::vector<Fixup> fixups {};
+
+			uint32_t block_id(size_t level, const std::string& name);
+			uint32_t literal(const std::string& str);
+			void accessor(AccessorTable& table, std::string body);
+			std::string scoped(const std::vector<LoopScope>& loops, const std::string& body) const;
+			void lower(const std::vector<NodePtr>& nodes, size_t level, std::vector<LoopScope>& loops);
+		public:
+			ASTPtr ast;
+			// Parameters of the extends chain, base template first so slots stay stable in extending templates
+			std::vector<ParameterPtr> params {};
+			// Slots appended directly, only those get an accessor as not every parameter is a string
+			std::set<size_t> used_params {};
+			std::vector<uint32_t> code {};
+			std::vector<uint32_t> blocks {};
+			std::string literals {};
+			AccessorTable exprs {};
+			AccessorTable conds {};
+			AccessorTable loops {};
+			size_t max_depth = 0;
+			uint64_t hash = 0;
+
+			explicit Program(ASTPtr a);
+		};
+
+		Program::Program(ASTPtr a) : ast(a) {
+			for(ASTPtr l = ast; l; l = l->is_base_ast() ? nullptr : std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast())
+				levels.push_back(l);
+			for(auto it = levels.rbegin(); it != levels.rend(); it++)
+				for(auto& p : (*it)->get_parameters())
+					params.push_back(p);
+
+			std::vector<LoopScope> scopes;
+			lower(std::dynamic_pointer_cast<BaseTemplateAST>(levels.back())->get_nodes(), levels.size() - 1, scopes);
+			code.push_back(BytecodeGenerator::OP_RETURN);
+			// Blocks are laid out after the main program in the order they are first referenced
+			for(size_t i = 0; i < block_queue.size(); i++) {
+				auto level = block_queue[i].first;
+				blocks.push_back(code.size());
+				lower(levels[level]->get_block(block_queue[i].second)->get_nodes(), level, scopes);
+				code.push_back(BytecodeGenerator::OP_RETURN);
+			}
+
+			for(auto table : { &exprs, &conds, &loops }) {
+				uint32_t idx = 0;
+				for(auto& e : *table) e.second = idx++;
+			}
+			for(auto& f : fixups)
+				code[f.pos] = f.table->at(f.body);
+
+			// FNV-1a over everything the bytecode relies on in the binding
+			hash = 0xcbf29ce484222325ull;
+			auto feed = [this](const std::string& str) {
+				for(size_t i = 0; i <= str.size(); i++) {
+					hash ^= static_cast<uint8_t>(str.c_str()[i]);
+					hash *= 0x100000001b3ull;
+				}
+			};
+			feed(std::to_string(BytecodeGenerator::VERSION));
+			for(auto& p : params) feed(p->get_name());
+			for(auto slot : used_params) feed(std::to_string(slot));
+			for(auto table : { &exprs, &conds, &loops }) {
+				feed("--");
+				for(auto& e : *table) feed(e.first);
+			}
+		}
+
+		uint32_t Program::block_id(size_t level, const std::string& name) {
+			auto key = std::make_pair(level, name);
+			auto it = block_ids.find(key);
+			if(it != block_ids.end()) return it->second;
+			uint32_t id = block_queue.size();
+			block_ids[key] = id;
+			block_queue.push_back(key);
+			return id;
+		}
+
+		uint32_t Program::literal(const std::string& str) {
+			auto it = literal_offsets.find(str);
+			if(it != literal_offsets.end()) return it->second;
+			uint32_t offset = literals.size();
+			literals += str;
+			literal_offsets[str] = offset;
+			return offset;
+		}
+
+		void Program::accessor(AccessorTable& table, std::string body) {
+			table.emplace(body, 0);
+			fixups.push_back({ code.size(), &table, std::move(body) });
+			code.push_back(0);
+		}
+
+		std::string Program::scoped(const std::vector<LoopScope>& scopes, const std::string& body) const {
+			std::string res;
+			res += "\tstd::string& str = f.str; (void)str;\n";
+			res += "\tauto& p = static_cast<params&>(f.p); (void)p;\n";
+			std::set<std::string> declared;
+			for(auto& param : params) {
+				res += "\tauto& " + param->get_name() + " = p." + param->get_name() + "; (void)" + param->get_name() + ";\n";
+				declared.insert(param->get_name());
+			}
+			// A variable shadowing an outer one gets a block of its own, its value may still use the outer one
+			std::string indent = "\t";
+			size_t depth = 0;
+			for(size_t i = 0; i < scopes.size(); i++) {
+				if(!declared.insert(scopes[i].variable).second) {
+					res += indent + "{\n";
+					indent += "\t";
+					depth++;
+					declared = { scopes[i].variable };
+				}
+				auto type = "loop_" + std::to_string(i) + "_t";
+				res += indent + "using " + type + " = " + scopes[i].type + ";\n";
+				res += indent + "auto& " + scopes[i].variable + " = *static_cast<" + type + "*>(f.slots[" + std::to_string(i) + "]); (void)" + scopes[i].variable + ";\n";
+			}
+			std::istringstream iss(body);
+			std::string line;
+			while(std::getline(iss, line))
+				res += indent.substr(1) + line + "\n";
+			for(; depth > 0; depth--)
+				res += std::string(depth, '\t') + "}\n";
+			return res;
+		}
+
+
+		void Program::lower(const std::vector<NodePtr>& nodes, size_t level, std::vector<LoopScope>& scopes) {
+			// Loop and let variables hide deferred params of the same name
+			std::set<std::string> shadowing;
+			for(auto& s : scopes) shadowing.insert(s.variable);
+			for(auto& onode : nodes) {
+				auto node = Generator::ReplaceMacros(onode, levels[level]);
+				switch(node->get_type()) {
+					case NodeType::AppendString: {
+						auto& data = std::dynamic_pointer_cast<AppendStringNode>(node)->get_data();
+						if(data.empty()) break;
+						code.push_back(BytecodeGenerator::OP_TEXT);
+						code.push_back(literal(data));
+						code.push_back(data.size());
+						break;
+					}
+					case NodeType::Expression: {
+						auto expr = Generator::AwaitParams(std::dynamic_pointer_cast<ExpressionNode>(node)->get_code(), levels[level], shadowing);
+						// A plain parameter is loaded through its slot and does not need an accessor of its own,
+						// deferred ones are awaited by one
+						auto name = trim_copy(expr);
+						bool shadowed = false;
+						for(auto& s : scopes) shadowed = shadowed || s.variable == name;
+						size_t slot = 0;
+						while(!shadowed && slot < params.size() && (params[slot]->get_name() != name || params[slot]->is_deferred())) slot++;
+						if(!shadowed && slot < params.size()) {
+							code.push_back(BytecodeGenerator::OP_PARAM);
+							code.push_back(slot);
+							used_params.insert(slot);
+						} else {
+							code.push_back(BytecodeGenerator::OP_EXPR);
+							accessor(exprs, scoped(scopes, "\tstr.append(" + expr + ");\n"));
+						}
+						break;
+					}
+					case NodeType::BlockCall: {
+						auto& name = std::dynamic_pointer_cast<BlockCallNode>(node)->get_block();
+						size_t l = 0;
+						while(l < levels.size() && !levels[l]->get_block(name)) l++;
+						if(l == levels.size()) throw std::runtime_error("unknown block " + name);
+						code.push_back(BytecodeGenerator::OP_CALL);
+						code.push_back(block_id(l, name));
+						break;
+					}
+					case NodeType::BlockParentCall: {
+						auto& name = std::dynamic_pointer_cast<BlockParentCallNode>(node)->get_block();
+						size_t l = level + 1;
+						while(l < levels.size() && !levels[l]->get_block(name)) l++;
+						if(l == levels.size()) throw std::runtime_error("block " + name + " has no parent");
+						code.push_back(BytecodeGenerator::OP_CALL);
+						code.push_back(block_id(l, name));
+						break;
+					}
+					case NodeType::Static:
+						// Stored by the compiled class, the interpreter only appends it
+						code.push_back(BytecodeGenerator::OP_EXPR);
+						accessor(exprs, scoped(scopes, "\tstr.append(" + Generator::StaticSection(levels[level], std::dynamic_pointer_cast<StaticNode>(node)->get_index(), GeneratorOptions()) + ");\n"));
+						break;
+					case NodeType::Translation:
+						throw std::runtime_error("translations are not supported in bytecode, " + std::dynamic_pointer_cast<TranslationNode>(node)->get_key() + " has no catalog");
+					case NodeType::ForEachLoop: {
+						// Parallel loops run serially, the interpreter has no executor
+						auto l = std::dynamic_pointer_cast<ForEachLoopNode>(node);
+						auto source = Generator::AwaitParams(l->get_source(), levels[level], shadowing);
+						auto slot = std::to_string(scopes.size());
+						code.push_back(BytecodeGenerator::OP_LOOP);
+						accessor(loops, scoped(scopes, "\tfor(auto& " + l->get_variable_name() + " : " + source + ") {\n"
+							+ "\t\tf.slots[" + slot + "] = const_cast<void*>(static_cast<const void*>(std::addressof(" + l->get_variable_name() + ")));\n"
+							+ "\t\texec(f, begin, end);\n"
+							+ "\t}\n"));
+						auto end = code.size();
+						code.push_back(0);
+						scopes.push_back({ l->get_variable_name(), "std::remove_reference_t<decltype(*std::begin(" + source + "))>" });
+						max_depth = std::max(max_depth, scopes.size());
+						lower(l->get_nodes(), level, scopes);
+						scopes.pop_back();
+						code[end] = code.size();
+						break;
+					}
+					case NodeType::Let: {
+						// Lowered as a loop over the single value, the body finds it through a slot like a loop variable.
+						// Pure expressions are evaluated where they are used, sharing them is up to the compiled render.
+						auto l = std::dynamic_pointer_cast<LetNode>(node);
+						auto value = Generator::AwaitParams(l->get_code(), levels[level], shadowing);
+						auto slot = std::to_string(scopes.size());
+						code.push_back(BytecodeGenerator::OP_LOOP);
+						accessor(loops, scoped(scopes, "\tauto&& let_value = " + value + ";\n"
+							+ "\tf.slots[" + slot + "] = const_cast<void*>(static_cast<const void*>(std::addressof(let_value)));\n"
+							+ "\texec(f, begin, end);\n"));
+						auto end = code.size();
+						code.push_back(0);
+						scopes.push_back({ l->get_name(), "std::remove_reference_t<decltype((" + value + "))>" });
+						max_depth = std::max(max_depth, scopes.size());
+						lower(l->get_nodes(), level, scopes);
+						scopes.pop_back();
+						code[end] = code.size();
+						break;
+					}
+					case NodeType::Conditional: {
+						auto cn = std::dynamic_pointer_cast<ConditionNode>(node);
+						auto& branches = cn->get_branches();
+						std::vector<size_t> exits;
+						for(size_t i = 0; i < branches.size(); i++) {
+							code.push_back(BytecodeGenerator::OP_JUMP_IF_NOT);
+							accessor(conds, scoped(scopes, "\treturn (" + Generator::AwaitParams(branches[i].first, levels[level], shadowing) + ") ? true : false;\n"));
+							auto next = code.size();
+							code.push_back(0);
+							lower(branches[i].second, level, scopes);
+							if(i + 1 != branches.size() || !cn->get_else_branch().empty()) {
+								code.push_back(BytecodeGenerator::OP_JUMP);
+								exits.push_back(code.size());
+								code.push_back(0);
+							}
+							code[next] = code.size();
+						}
+						lower(cn->get_else_branch(), level, scopes);
+						for(auto e : exits) code[e] = code.size();
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	std::string BytecodeGenerator::GenerateBytecode(ASTPtr ast) {
+		// Written in host byte order, the interpreter maps the file and reads the words in place
+		Program prog(ast);
+		std::string res(MAGIC, sizeof(MAGIC));
+		auto word = [&res](uint32_t v) { res.append(reinterpret_cast<const char*>(&v), sizeof(v)); };
+		word(VERSION);
+		word(static_cast<uint32_t>(prog.hash));
+		word(static_cast<uint32_t>(prog.hash >> 32));
+		word(prog.code.size());
+		word(prog.blocks.size());
+		word(prog.literals.size());
+		for(auto b : prog.blocks) word(b);
+		for(auto c : prog.code) word(c);
+		res += prog.literals;
+		return res;
+	}
+
+	std::string BytecodeGenerator::GenerateHeader(ASTPtr ast) {
+		Program prog(ast);
+		auto cls = ast->get_classname() + "_vm";
+		const static std::string TAB = "\t";
+		std::ostringstream header;
+		header << "#pragma once" << std::endl;
+		header << "#include \"" << ast->get_classname() << ".h\"" << std::endl;
+		header << "#include <cstdint>" << std::endl;
+		header << "#include <string>" << std::endl;
+		for(auto& ns : split(ast->get_namespace(), "::"))
+		{
+			header << "namespace " << ns << " {" << std::endl;
+		}
+		header << "class " << cls << " : public " << ast->get_classname() << std::endl;
+		header << "{" << std::endl;
+		header << TAB << "public:" << std::endl;
+		header << TAB << TAB << cls << "();" << std::endl;
+		header << TAB << TAB << "virtual ~" << cls << "();" << std::endl;
+		header << TAB << TAB << cls << "(const " << cls << "&) = delete;" << std::endl;
+		header << TAB << TAB << cls << "& operator=(const " << cls << "&) = delete;" << std::endl;
+		header << std::endl;
+		header << TAB << TAB << "// Maps a bytecode file compiled against this binding, throws if it does not match" << std::endl;
+		header << TAB << TAB << "void load(const std::string& fname);" << std::endl;
+		header << TAB << TAB << "std::string render(base_params& p) const;" << std::endl;
+		header << TAB << TAB << "void render(std::string& str, base_params& p) const;" << std::endl;
+		header << std::endl;
+		char hash[24];
+		snprintf(hash, sizeof(hash), "0x%016llxull", static_cast<unsigned long long>(prog.hash));
+		header << TAB << TAB << "static const uint64_t binding_hash = " << hash << ";" << std::endl;
+		header << TAB << "protected:" << std::endl;
+		header << TAB << TAB << "struct frame" << std::endl;
+		header << TAB << TAB << "{" << std::endl;
+		header << TAB << TAB << TAB << "std::string& str;" << std::endl;
+		header << TAB << TAB << TAB << "base_params& p;" << std::endl;
+		header << TAB << TAB << TAB << "void* slots[" << std::max<size_t>(prog.max_depth, 1) << "];" << std::endl;
+		header << TAB << TAB << "};" << std::endl;
+		header << TAB << TAB << "void exec(frame& f, uint32_t pc, uint32_t end) const;" << std::endl;
+		header << std::endl;
+		for(auto i : prog.used_params)
+			header << TAB << TAB << "void param_" << i << "(frame& f) const;" << std::endl;
+		for(size_t i = 0; i < prog.exprs.size(); i++)
+			header << TAB << TAB << "void expr_" << i << "(frame& f) const;" << std::endl;
+		for(size_t i = 0; i < prog.conds.size(); i++)
+			header << TAB << TAB << "bool cond_" << i << "(frame& f) const;" << std::endl;
+		for(size_t i = 0; i < prog.loops.size(); i++)
+			header << TAB << TAB << "void loop_" << i << "(frame& f, uint32_t begin, uint32_t end) const;" << std::endl;
+		header << TAB << "private:" << std::endl;
+		header << TAB << TAB << "void unload();" << std::endl;
+		header << TAB << TAB << "void verify() const;" << std::endl;
+		header << std::endl;
+		header << TAB << TAB << "std::string buffer {};" << std::endl;
+		header << TAB << TAB << "void* mapping = nullptr;" << std::endl;
+		header << TAB << TAB << "size_t mapping_size = 0;" << std::endl;
+		header << TAB << TAB << "const uint32_t* code = nullptr;" << std::endl;
+		header << TAB << TAB << "const uint32_t* blocks = nullptr;" << std::endl;
+		header << TAB << TAB << "const char* literals = nullptr;" << std::endl;
+		header << TAB << TAB << "uint32_t code_size = 0;" << std::endl;
+		header << TAB << TAB << "uint32_t block_count = 0;" << std::endl;
+		header << TAB << TAB << "uint32_t literal_size = 0;" << std::endl;
+		header << std::endl;
+		header << TAB << TAB << "static void (" << cls << "::* const params_table[])(frame&) const;" << std::endl;
+		header << TAB << TAB << "static void (" << cls << "::* const exprs_table[])(frame&) const;" << std::endl;
+		header << TAB << TAB << "static bool (" << cls << "::* const conds_table[])(frame&) const;" << std::endl;
+		header << TAB << TAB << "static void (" << cls << "::* const loops_table[])(frame&, uint32_t, uint32_t) const;" << std::endl;
+		header << "};" << std::endl;
+		for(auto& ns : split(ast->get_namespace(), "::"))
+		{
+			header << "} // namespace " << ns << std::endl;
+		}
+		return header.str();
+	}
+
+	std::string BytecodeGenerator::GenerateImplementation(ASTPtr ast, const GeneratorOptions& options) {
+		Program prog(ast);
+		auto cls = ast->get_classname() + "_vm";
+		const static std::string TAB = "\t";
+		std::ostringstream impl;
+		impl << "#include \"" << cls << ".h\"" << std::endl;
+		// Accessors read the params of the whole chain
+		if(options.lean_header)
+			impl << "#include \"" << ast->get_classname() << "_params.h\"" << std::endl;
+		for(ASTPtr l = ast; l; l = l->is_base_ast() ? nullptr : std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast()) {
+			for(auto& s : l->get_implementation_includes())
+				impl << "#include " << s << std::endl;
+		}
+		impl << "#include <chrono>" << std::endl;
+		impl << "#include <cstring>" << std::endl;
+		impl << "#include <fstream>" << std::endl;
+		impl << "#include <iterator>" << std::endl;
+		impl << "#include <memory>" << std::endl;
+		impl << "#include <sstream>" << std::endl;
+		impl << "#include <stdexcept>" << std::endl;
+		impl << "#include <type_traits>" << std::endl;
+		impl << "#include <typeinfo>" << std::endl;
+		impl << "#include <utility>" << std::endl;
+		impl << "#include <vector>" << std::endl;
+		impl << "#ifndef _WIN32" << std::endl;
+		impl << "#include <fcntl.h>" << std::endl;
+		impl << "#include <sys/mman.h>" << std::endl;
+		impl << "#include <sys/stat.h>" << std::endl;
+		impl << "#include <unistd.h>" << std::endl;
+		impl << "#endif" << std::endl;
+		for(auto& ns : split(ast->get_namespace(), "::"))
+		{
+			impl << "namespace " << ns << " {" << std::endl;
+		}
+		impl << std::endl;
+
+		auto table = [&](const std::string& ret, const std::string& args, const std::string& name, const std::string& prefix, size_t count) {
+			impl << ret << " (" << cls << "::* const " << cls << "::" << name << "[])(" << args << ") const = {" << std::endl;
+			for(size_t i = 0; i < count; i++)
+				impl << TAB << "&" << cls << "::" << prefix << i << "," << std::endl;
+			impl << TAB << "nullptr" << std::endl;
+			impl << "};" << std::endl;
+			impl << std::endl;
+		};
+		impl << "void (" << cls << "::* const " << cls << "::params_table[])(frame&) const = {" << std::endl;
+		for(size_t i = 0; i < prog.params.size(); i++) {
+			if(prog.used_params.count(i)) impl << TAB << "&" << cls << "::param_" << i << "," << std::endl;
+			else impl << TAB << "nullptr," << std::endl;
+		}
+		impl << TAB << "nullptr" << std::endl;
+		impl << "};" << std::endl;
+		impl << std::endl;
+		table("void", "frame&", "exprs_table", "expr_", prog.exprs.size());
+		table("bool", "frame&", "conds_table", "cond_", prog.conds.size());
+		table("void", "frame&, uint32_t, uint32_t", "loops_table", "loop_", prog.loops.size());
+
+		impl << cls << "::" << cls << "()" << std::endl;
+		impl << "{" << std::endl;
+		impl << "}" << std::endl;
+		impl << std::endl;
+		impl << cls << "::~" << cls << "()" << std::endl;
+		impl << "{" << std::endl;
+		impl << TAB << "this->unload();" << std::endl;
+		impl << "}" << std::endl;
+		impl << std::endl;
+
+		impl << "void " << cls << "::unload()" << std::endl;
+		impl << "{" << std::endl;
+		impl << "#ifndef _WIN32" << std::endl;
+		impl << TAB << "if(mapping) munmap(mapping, mapping_size);" << std::endl;
+		impl << "#endif" << std::endl;
+		impl << TAB << "buffer.clear();" << std::endl;
+		impl << TAB << "mapping = nullptr;" << std::endl;
+		impl << TAB << "mapping_size = 0;" << std::endl;
+		impl << TAB << "code = blocks = nullptr;" << std::endl;
+		impl << TAB << "literals = nullptr;" << std::endl;
+		impl << TAB << "code_size = block_count = literal_size = 0;" << std::endl;
+		impl << "}" << std::endl;
+		impl << std::endl;
+
+		impl << "void " << cls << "::load(const std::string& fname)" << std::endl;
+		impl << "{" << std::endl;
+		impl << TAB << "this->unload();" << std::endl;
+		impl << "#ifndef _WIN32" << std::endl;
+		impl << TAB << "int fd = open(fname.c_str(), O_RDONLY);" << std::endl;
+		impl << TAB << "if(fd < 0) throw std::runtime_error(\"failed to open \" + fname);" << std::endl;
+		impl << TAB << "struct stat st;" << std::endl;
+		impl << TAB << "if(fstat(fd, &st) != 0 || st.st_size == 0) {" << std::endl;
+		impl << TAB << TAB << "close(fd);" << std::endl;
+		impl << TAB << TAB << "throw std::runtime_error(\"failed to read \" + fname);" << std::endl;
+		impl << TAB << "}" << std::endl;
+		impl << TAB << "void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);" << std::endl;
+		impl << TAB << "close(fd);" << std::endl;
+		impl << TAB << "if(data == MAP_FAILED) throw std::runtime_error(\"failed to map \" + fname);" << std::endl;
+		impl << TAB << "mapping = data;" << std::endl;
+		impl << TAB << "mapping_size = st.st_size;" << std::endl;
+		impl << TAB << "const char* ptr = static_cast<const char*>(data);" << std::endl;
+		impl << TAB << "size_t size = mapping_size;" << std::endl;
+		impl << "#else" << std::endl;
+		impl << TAB << "std::ifstream in(fname, std::ios::binary);" << std::endl;
+		impl << TAB << "if(!in) throw std::runtime_error(\"failed to open \" + fname);" << std::endl;
+		impl << TAB << "std::ostringstream ss;" << std::endl;
+		impl << TAB << "ss << in.rdbuf();" << std::endl;
+		impl << TAB << "buffer = ss.str();" << std::endl;
+		impl << TAB << "const char* ptr = buffer.data();" << std::endl;
+		impl << TAB << "size_t size = buffer.size();" << std::endl;
+		impl << "#endif" << std::endl;
+		impl << TAB << "try {" << std::endl;
+		impl << TAB << TAB << "// Magic, version, binding hash, code size, block count, literal size" << std::endl;
+		impl << TAB << TAB << "uint32_t header[6];" << std::endl;
+		impl << TAB << TAB << "if(size < " << HEADER_SIZE << " || memcmp(ptr, \"CTPLBC\\0\\0\", 8) != 0) throw std::runtime_error(\"not a template bytecode file\");" << std::endl;
+		impl << TAB << TAB << "memcpy(header, ptr + 8, sizeof(header));" << std::endl;
+		impl << TAB << TAB << "if(header[0] != " << VERSION << ") throw std::runtime_error(\"unsupported bytecode version\");" << std::endl;
+		impl << TAB << TAB << "if(((static_cast<uint64_t>(header[2]) << 32) | header[1]) != binding_hash) throw std::runtime_error(\"bytecode was compiled for a different binding\");" << std::endl;
+		impl << TAB << TAB << "code_size = header[3];" << std::endl;
+		impl << TAB << TAB << "block_count = header[4];" << std::endl;
+		impl << TAB << TAB << "literal_size = header[5];" << std::endl;
+		impl << TAB << TAB << "if(" << HEADER_SIZE << " + (static_cast<uint64_t>(block_count) + code_size) * 4 + literal_size > size) throw std::runtime_error(\"truncated bytecode file\");" << std::endl;
+		impl << TAB << TAB << "blocks = reinterpret_cast<const uint32_t*>(ptr + " << HEADER_SIZE << ");" << std::endl;
+		impl << TAB << TAB << "code = blocks + block_count;" << std::endl;
+		impl << TAB << TAB << "literals = reinterpret_cast<const char*>(code + code_size);" << std::endl;
+		impl << TAB << TAB << "this->verify();" << std::endl;
+		impl << TAB << "} catch(...) {" << std::endl;
+		impl << TAB << TAB << "this->unload();" << std::endl;
+		impl << TAB << TAB << "throw;" << std::endl;
+		impl << TAB << "}" << std::endl;
+		impl << "}" << std::endl;
+		impl << std::endl;
+
+		// Checking every operand once on load keeps the interpreter loop free of bounds checks.
+		// Code is split into segments, each up to and including a return, control flow has to stay within one
+		// and land on an instruction, and calls between segments must not form a cycle as exec recurses on them.
+		impl << "void " << cls << "::verify() const" << std::endl;
+		impl << "{" << std::endl;
+		impl << TAB << "// Segment of every instruction start, none for operands, the end counts as a start of the last one" << std::endl;
+		impl << TAB << "const uint32_t none = UINT32_MAX;" << std::endl;
+		impl << TAB << "std::vector<uint32_t> segment(static_cast<size_t>(code_size) + 1, none);" << std::endl;
+		impl << TAB << "std::vector<std::pair<uint32_t, uint32_t>> jumps, calls;" << std::endl;
+		impl << TAB << "uint32_t pc = 0, seg = 0;" << std::endl;
+		impl << TAB << "auto check = [&](uint32_t len, bool valid) {" << std::endl;
+		impl << TAB << TAB << "if(code_size - pc < len || !valid) throw std::runtime_error(\"invalid instruction in bytecode at \" + std::to_string(pc));" << std::endl;
+		impl << TAB << TAB << "pc += len;" << std::endl;
+		impl << TAB << "};" << std::endl;
+		impl << TAB << "auto arg = [&](uint32_t i) { return pc + i < code_size ? code[pc + i] : 0; };" << std::endl;
+		// Accessor tables may be empty, comparing through a function keeps -Wtype-limits quiet
+		impl << TAB << "auto below = [](uint32_t v, uint32_t n) { return v < n; };" << std::endl;
+		impl << TAB << "while(pc < code_size) {" << std::endl;
+		impl << TAB << TAB << "segment[pc] = seg;" << std::endl;
+		impl << TAB << TAB << "switch(code[pc]) {" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_TEXT << ": check(3, static_cast<uint64_t>(arg(1)) + arg(2) <= literal_size); break;" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_PARAM << ": check(2, below(arg(1), " << prog.params.size() << ") && params_table[arg(1)]); break;" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_EXPR << ": check(2, below(arg(1), " << prog.exprs.size() << ")); break;" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_JUMP_IF_NOT << ":" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "jumps.emplace_back(pc, arg(2));" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "check(3, below(arg(1), " << prog.conds.size() << ") && arg(2) > pc && arg(2) <= code_size);" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "break;" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_JUMP << ":" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "jumps.emplace_back(pc, arg(1));" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "check(2, arg(1) > pc && arg(1) <= code_size);" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "break;" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_LOOP << ":" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "jumps.emplace_back(pc, arg(2));" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "check(3, below(arg(1), " << prog.loops.size() << ") && arg(2) >= pc + 3 && arg(2) <= code_size);" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "break;" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_CALL << ":" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "calls.emplace_back(seg, arg(1));" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "check(2, arg(1) < block_count);" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "break;" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_RETURN << ": check(1, true); seg++; break;" << std::endl;
+		impl << TAB << TAB << TAB << "default: check(1, false);" << std::endl;
+		impl << TAB << TAB << "}" << std::endl;
+		impl << TAB << "}" << std::endl;
+		impl << TAB << "segment[code_size] = seg;" << std::endl;
+		impl << TAB << "for(auto& j : jumps) {" << std::endl;
+		impl << TAB << TAB << "if(segment[j.second] != segment[j.first]) throw std::runtime_error(\"invalid jump target in bytecode at \" + std::to_string(j.first));" << std::endl;
+		impl << TAB << "}" << std::endl;
+		impl << TAB << "for(uint32_t i = 0; i < block_count; i++) {" << std::endl;
+		impl << TAB << TAB << "if(blocks[i] >= code_size || segment[blocks[i]] == none) throw std::runtime_error(\"invalid block offset in bytecode\");" << std::endl;
+		impl << TAB << "}" << std::endl;
+		impl << TAB << "// Topological order of the call graph, whatever is left over is part of a cycle" << std::endl;
+		impl << TAB << "std::vector<std::vector<uint32_t>> callees(static_cast<size_t>(seg) + 1);" << std::endl;
+		impl << TAB << "std::vector<uint32_t> callers(static_cast<size_t>(seg) + 1);" << std::endl;
+		impl << TAB << "for(auto& c : calls) {" << std::endl;
+		impl << TAB << TAB << "callees[c.first].push_back(segment[blocks[c.second]]);" << std::endl;
+		impl << TAB << TAB << "callers[segment[blocks[c.second]]]++;" << std::endl;
+		impl << TAB << "}" << std::endl;
+		impl << TAB << "std::vector<uint32_t> ready;" << std::endl;
+		impl << TAB << "for(uint32_t s = 0; s <= seg; s++)" << std::endl;
+		impl << TAB << TAB << "if(!callers[s]) ready.push_back(s);" << std::endl;
+		impl << TAB << "size_t ordered = 0;" << std::endl;
+		impl << TAB << "while(!ready.empty()) {" << std::endl;
+		impl << TAB << TAB << "auto s = ready.back();" << std::endl;
+		impl << TAB << TAB << "ready.pop_back();" << std::endl;
+		impl << TAB << TAB << "ordered++;" << std::endl;
+		impl << TAB << TAB << "for(auto callee : callees[s])" << std::endl;
+		impl << TAB << TAB << TAB << "if(!--callers[callee]) ready.push_back(callee);" << std::endl;
+		impl << TAB << "}" << std::endl;
+		impl << TAB << "if(ordered != callees.size()) throw std::runtime_error(\"recursive block calls in bytecode\");" << std::endl;
+		impl << "}" << std::endl;
+		impl << std::endl;
+
+		impl << "void " << cls << "::exec(frame& f, uint32_t pc, uint32_t end) const" << std::endl;
+		impl << "{" << std::endl;
+		impl << TAB << "while(pc < end) {" << std::endl;
+		impl << TAB << TAB << "switch(code[pc]) {" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_TEXT << ":" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "f.str.append(literals + code[pc + 1], code[pc + 2]);" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "pc += 3;" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "break;" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_PARAM << ":" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "(this->*params_table[code[pc + 1]])(f);" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "pc += 2;" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "break;" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_EXPR << ":" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "(this->*exprs_table[code[pc + 1]])(f);" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "pc += 2;" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "break;" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_JUMP_IF_NOT << ":" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "pc = (this->*conds_table[code[pc + 1]])(f) ? pc + 3 : code[pc + 2];" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "break;" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_JUMP << ":" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "pc = code[pc + 1];" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "break;" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_LOOP << ":" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "(this->*loops_table[code[pc + 1]])(f, pc + 3, code[pc + 2]);" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "pc = code[pc + 2];" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "break;" << std::endl;
+		impl << TAB << TAB << TAB << "case " << OP_CALL << ":" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "this->exec(f, blocks[code[pc + 1]], code_size);" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "pc += 2;" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "break;" << std::endl;
+		impl << TAB << TAB << TAB << "default:" << std::endl;
+		impl << TAB << TAB << TAB << TAB << "return;" << std::endl;
+		impl << TAB << TAB << "}" << std::endl;
+		impl << TAB << "}" << std::endl;
+		impl << "}" << std::endl;
+		impl << std::endl;
+
+		impl << "std::string " << cls << "::render(base_params& p) const" << std::endl;
+		impl << "{" << std::endl;
+		impl << TAB << "std::string res;" << std::endl;
+		impl << TAB << "this->render(res, p);" << std::endl;
+		impl << TAB << "return res;" << std::endl;
+		impl << "}" << std::endl;
+		impl << std::endl;
+		impl << "void " << cls << "::render(std::string& str, base_params& p) const" << std::endl;
+		impl << "{" << std::endl;
+		impl << TAB << "if(typeid(p) != get_param_type()) throw std::invalid_argument(\"invalid param struct\");" << std::endl;
+		impl << TAB << "if(!code) throw std::logic_error(\"no bytecode loaded\");" << std::endl;
+		impl << TAB << "this->prerender(p);" << std::endl;
+		impl << TAB << "frame f { str, p, {} };" << std::endl;
+		impl << TAB << "this->exec(f, 0, code_size);" << std::endl;
+		impl << TAB << "this->postrender(p);" << std::endl;
+		impl << "}" << std::endl;
+		impl << std::endl;
+
+		for(auto i : prog.used_params) {
+			impl << "void " << cls << "::param_" << i << "(frame& f) const" << std::endl;
+			impl << "{" << std::endl;
+			if(!options.utf8.empty())
+				impl << TAB << "f.str.append(valid_utf8(static_cast<params&>(f.p)." << prog.params[i]->get_name() << "));" << std::endl;
+			else
+				impl << TAB << "f.str.append(static_cast<params&>(f.p)." << prog.params[i]->get_name() << ");" << std::endl;
+			impl << "}" << std::endl;
+			impl << std::endl;
+		}
+		// Snapshots of atomic variables are pinned and output is validated outside of the accessor body,
+		// which is part of the binding hash
+		auto variables = options.atomic_variables ? Generator::BuildVariablesBlock(ast, options, TAB) : "";
+		auto accessors = [&](const AccessorTable& t, const std::string& ret, const std::string& prefix, const std::string& args, bool output) {
+			bool utf8 = output && !options.utf8.empty();
+			for(auto& e : t) {
+				impl << ret << " " << cls << "::" << prefix << e.second << "(" << args << ") const" << std::endl;
+				impl << "{" << std::endl;
+				if(variables.empty() && !utf8) {
+					impl << e.first;
+				} else {
+					// The body gets a scope of its own, its params and loop variables may hide a variable
+					impl << variables;
+					if(utf8)
+						impl << TAB << "const size_t utf8_start = f.str.size();" << std::endl;
+					impl << TAB << "{" << std::endl;
+					std::istringstream iss(e.first);
+					std::string line;
+					while(std::getline(iss, line)) impl << TAB << line << std::endl;
+					impl << TAB << "}" << std::endl;
+					if(utf8)
+						impl << TAB << "valid_utf8_tail(f.str, utf8_start);" << std::endl;
+				}
+				impl << "}" << std::endl;
+				impl << std::endl;
+			}
+		};
+		accessors(prog.exprs, "void", "expr_", "frame& f", true);
+		accessors(prog.conds, "bool", "cond_", "frame& f", false);
+		accessors(prog.loops, "void", "loop_", "frame& f, uint32_t begin, uint32_t end", false);
+
+		for(auto& ns : split(ast->get_namespace(), "::"))
+		{
+			impl << "} // namespace " << ns << std::endl;
+		}
+		return impl.str();
+	}
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "AST.h"
+#include "Generator.h"
+#include <cstdint>
+
+namespace cpptemplate {
+	// Lowers a template into bytecode run by a small interpreter instead of generated C++.
+	// Literals and control flow live in the bytecode file, while expressions, conditions
+	// and loop sources are C++ and therefore compiled into an accessor table of a
+	// binding class <classname>_vm deriving from the regular generated class.
+	// A bytecode file can be replaced without a rebuild as long as the set of accessors
+	// stays the same, which the binding verifies through a hash when loading it.
+	class BytecodeGenerator {
+	public:
+		static const uint32_t VERSION = 1;
+
+		enum Opcode : uint32_t {
+			OP_TEXT = 1,        // offset, length: append a slice of the literal table
+			OP_PARAM = 2,       // slot: append a parameter of the extends chain
+			OP_EXPR = 3,        // accessor: append an expression
+			OP_JUMP_IF_NOT = 4, // accessor, target: jump unless the condition holds
+			OP_JUMP = 5,        // target
+			OP_LOOP = 6,        // accessor, end: run the following body up to end once per element, or once for a let
+			OP_CALL = 7,        // block: run a block from the block dispatch table
+			OP_RETURN = 8
+		};
+
+		static std::string GenerateBytecode(ASTPtr ast);
+		static std::string GenerateHeader(ASTPtr ast);
+		static std::string GenerateImplementation(ASTPtr ast, const GeneratorOptions& options = GeneratorOptions());
+	};
+}
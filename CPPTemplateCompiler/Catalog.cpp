@@ -0,0 +1,60 @@
+#include "Catalog.h"
+#include "StringHelper.h"
+#include <fstream>
+
+namespace cpptemplate {
+	CatalogPtr Catalog::ParseStream(std::istream& is, const std::string& locale) {
+		auto ptr = std::make_shared<Catalog>();
+		ptr->locale = locale;
+		std::string line;
+		size_t cnt_line = 0;
+		while(std::getline(is, line)) {
+			cnt_line++;
+			auto trimmed = trim_copy(line);
+			if(trimmed.empty() || trimmed[0] == '#') continue;
+			auto pos = trimmed.find('=');
+			if(pos == std::string::npos)
+				throw std::runtime_error("invalid catalog entry at line " + std::to_string(cnt_line));
+			auto key = trim_copy(trimmed.substr(0, pos));
+			auto raw = trim_copy(trimmed.substr(pos + 1));
+			if(key.empty())
+				throw std::runtime_error("missing key in catalog at line " + std::to_string(cnt_line));
+			std::string value;
+			for(size_t i = 0; i < raw.size(); i++) {
+				if(raw[i] != '\\' || i + 1 == raw.size()) {
+					value += raw[i];
+					continue;
+				}
+				switch(raw[++i]) {
+					case 'n': value += '\n'; break;
+					case 't': value += '\t'; break;
+					case '\\': value += '\\'; break;
+					default: throw std::runtime_error("invalid escape in catalog at line " + std::to_string(cnt_line));
+				}
+			}
+			ptr->add(key, std::move(value));
+		}
+		return ptr;
+	}
+
+	CatalogPtr Catalog::ParseFile(const std::string& fname, const std::string& locale) {
+		std::ifstream str(fname, std::ios::binary);
+		if(!str) throw std::runtime_error("failed to open catalog " + fname);
+		return ParseStream(str, locale);
+	}
+
+	std::string Catalog::get_identifier() const {
+		std::string res = locale;
+		for(auto& c : res) {
+			if(!isalnum(static_cast<unsigned char>(c))) c = '_';
+		}
+		return res;
+	}
+
+	const std::string& Catalog::get(const std::string& key) const {
+		auto it = messages.find(key);
+		if(it == messages.end())
+			throw std::runtime_error("missing translation of " + key + " for locale " + locale);
+		return it->second;
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <string>
+
+namespace cpptemplate {
+	class Catalog;
+	typedef std::shared_ptr<Catalog> CatalogPtr;
+
+	// Messages of a single locale used to resolve {% trans key %} at compile time.
+	// Catalog files contain one "key = value" per line, empty lines and lines
+	// starting with # are ignored and values may contain \n, \t and \\ escapes.
+	class Catalog {
+		std::string locale {};
+		std::map<std::string, std::string> messages {};
+	public:
+		static CatalogPtr ParseStream(std::istream& is, const std::string& locale);
+		static CatalogPtr ParseFile(const std::string& fname, const std::string& locale);
+
+		const std::string& get_locale() const { return locale; }
+		// Locale name usable as an identifier in generated code
+		std::string get_identifier() const;
+		void add(const std::string& key, std::string value) { messages[key] = std::move(value); }
+		const std::string& get(const std::string& key) const;
+	};
+}
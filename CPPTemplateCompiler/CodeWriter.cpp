@@ -0,0 +1,114 @@
+#include "CodeWriter.h"
+#include <cstring>
+
+namespace cpptemplate {
+	const char* const CodeWriter::GENERATED_LINE = "#line __generated__";
+
+	bool CodeWriter::IndentBuffer::put_indent()
+	{
+		line_start = false;
+		for(size_t i = 0; i < level; i++)
+			if(target->sputc('\t') == traits_type::eof()) return false;
+		return true;
+	}
+
+	bool CodeWriter::IndentBuffer::start_line(const char* s, std::streamsize n, bool& skip)
+	{
+		// Called with the start of a line, which may be cut short for a single character
+		skip = false;
+		if(filename.empty()) return true;
+		// Nested writers may have indented it already
+		std::streamsize i = 0;
+		while(i < n && s[i] == '\t') i++;
+		std::string_view line(s + i, n - i);
+		if(line == GENERATED_LINE) {
+			pinned.clear();
+			skip = true;
+			return put_generated_line();
+		}
+		if(line.compare(0, 6, "#line ") == 0) {
+			pinned.assign(line.data(), line.size());
+			pinned_fresh = true;
+			return true;
+		}
+		if(pinned.empty()) return true;
+		if(pinned_fresh) {
+			pinned_fresh = false;
+			return true;
+		}
+		return put_pinned();
+	}
+
+	bool CodeWriter::IndentBuffer::put_pinned()
+	{
+		if(!put_indent()) return false;
+		if(target->sputn(pinned.data(), pinned.size()) != static_cast<std::streamsize>(pinned.size())) return false;
+		if(target->sputc('\n') == traits_type::eof()) return false;
+		lines++;
+		line_start = true;
+		return true;
+	}
+
+	bool CodeWriter::IndentBuffer::put_generated_line()
+	{
+		// Numbers the line following the directive
+		std::string line = "#line " + std::to_string(lines + 2) + " \"";
+		for(auto c : filename) {
+			if(c == '"' || c == '\\') line += '\\';
+			line += c;
+		}
+		line += '"';
+		line_start = false;
+		return target->sputn(line.data(), line.size()) == static_cast<std::streamsize>(line.size());
+	}
+
+	CodeWriter::IndentBuffer::int_type CodeWriter::IndentBuffer::overflow(int_type c)
+	{
+		if(traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+		auto ch = traits_type::to_char_type(c);
+		if(ch == '\n') {
+			line_start = true;
+			lines++;
+		} else if(line_start) {
+			bool skip;
+			if(!start_line(&ch, 1, skip) || !put_indent()) return traits_type::eof();
+		}
+		return target->sputc(ch);
+	}
+
+	std::streamsize CodeWriter::IndentBuffer::xsputn(const char* s, std::streamsize n)
+	{
+		// Forward whole lines at once, indentation only goes in front of the first character of a line
+		std::streamsize done = 0;
+		while(done < n) {
+			if(s[done] == '\n') {
+				if(target->sputc('\n') == traits_type::eof()) return done;
+				line_start = true;
+				lines++;
+				done++;
+				continue;
+			}
+			auto nl = static_cast<const char*>(memchr(s + done, '\n', n - done));
+			std::streamsize len = (nl ? nl - s : n) - done;
+			if(line_start) {
+				bool skip;
+				if(!start_line(s + done, len, skip)) return done;
+				if(skip) {
+					done += len;
+					continue;
+				}
+				if(!put_indent()) return done;
+			}
+			auto written = target->sputn(s + done, len);
+			done += written;
+			if(written != len) return done;
+		}
+		return done;
+	}
+
+	CodeWriter::CodeWriter(std::ostream& out, std::string filename)
+		: std::ostream(nullptr), buffer(out.rdbuf(), std::move(filename))
+	{
+		rdbuf(&buffer);
+	}
+}
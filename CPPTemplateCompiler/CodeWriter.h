@@ -0,0 +1,52 @@
+#pragma once
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+
+namespace cpptemplate {
+	// Writes generated code straight through to another stream, starting every non-empty line
+	// with the current indentation. Nested code is written at a deeper level instead of being
+	// built on its own and copied into its parent, so output is linear in its size.
+	// Flushing is left to the target, a file is written in as few calls as its buffer allows.
+	class CodeWriter : public std::ostream {
+		class IndentBuffer : public std::streambuf {
+			std::streambuf* target;
+			std::string filename;
+			// Last #line into a template, repeated in front of every further line of code it covers
+			std::string pinned {};
+			bool pinned_fresh = false;
+			size_t level = 0;
+			size_t lines = 0;
+			bool line_start = true;
+
+			bool put_indent();
+			bool start_line(const char* s, std::streamsize n, bool& skip);
+			bool put_pinned();
+			bool put_generated_line();
+		protected:
+			int_type overflow(int_type c) override;
+			std::streamsize xsputn(const char* s, std::streamsize n) override;
+			int sync() override { return 0; }
+		public:
+			IndentBuffer(std::streambuf* t, std::string f) : target(t), filename(std::move(f)) {}
+			IndentBuffer(const IndentBuffer&) = delete;
+			IndentBuffer& operator=(const IndentBuffer&) = delete;
+
+			void indent(size_t n) { level += n; }
+			void dedent(size_t n) { level -= n; }
+		};
+
+		IndentBuffer buffer;
+	public:
+		// A line of its own holding this returns to the generated file after #line directives into a template.
+		// Nested code does not know where it ends up, so only a writer given the name of the file resolves it.
+		// That writer also keeps every line of code following a directive on the template line it names.
+		static const char* const GENERATED_LINE;
+
+		explicit CodeWriter(std::ostream& out, std::string filename = std::string());
+
+		void indent(size_t n = 1) { buffer.indent(n); }
+		void dedent(size_t n = 1) { buffer.dedent(n); }
+	};
+}
@@ -1,8 +1,13 @@
 #include "Generator.h"
 #include "StringHelper.h"
+#include <algorithm>
 #include <sstream>
 #include <chrono>
 #include <iomanip>
+#include <map>
+#include <cstring>
+#include <cctype>
+#include <zlib.h>
 
 #ifdef __linux__
 #define mylocaltime(x,y) localtime_r(x,y)
@@ -11,6 +16,22 @@
 #endif
 
 namespace cpptemplate {
+	// Profile decisions need enough samples to not act on noise
+	static const uint64_t PROFILE_MIN_SAMPLES = 100;
+	// Branches taken with at least this probability get a likely hint, the inverse an unlikely hint
+	static const double PROFILE_LIKELY = 0.9;
+	// Branches taken below this probability are outlined into a cold function
+	static const double PROFILE_COLD = 0.01;
+	// Loops expected to append less static data than this are not worth a reserve
+	static const uint64_t PROFILE_MIN_RESERVE = 256;
+	// Shorter text is cheaper to compress at runtime together with its neighbours than to flush around,
+	// the flush also drops the history that repeated text in loops would compress against
+	static const size_t DEFLATE_MIN_LITERAL = 512;
+	// Combining a precomputed crc costs about as much as hashing this much text with crc32 instructions
+	static const size_t HASH_MIN_LITERAL = 128;
+	// Reflected CRC32C (Castagnoli) polynomial
+	static const uint32_t HASH_POLYNOMIAL = 0x82f63b78;
+
 	std::string Generator::BuildParamsBlock(ASTPtr ast)
 	{
 		std::string res;
@@ -32,20 +53,315 @@ namespace cpptemplate {
 		return res;
 	}
 
+	std::string Generator::BuildParamsStruct(ASTPtr ast, const std::string& name, const std::string& indent)
+	{
+		std::ostringstream res;
+		res << indent << "struct " << name << std::endl;
+		if(!ast->is_base_ast()) {
+			auto baseast = std::dynamic_pointer_cast<ExtendingTemplateAST>(ast)->get_base_template_ast();
+			res << indent << "\t: ::" << baseast->get_namespace() << "::" << baseast->get_classname() << "::params" << std::endl;
+		}
+		res << indent << "{" << std::endl;
+		if(ast->is_base_ast()) // We need a virtual method for typeid to return the correct type
+			res << indent << "\tvirtual ~params() {}" << std::endl;
+		for (auto& param : ast->get_parameters()) {
+			res << indent << "\t" << param->get_type() << " " << param->get_name() << " {};" << std::endl;
+		}
+		res << indent << "};" << std::endl;
+		return res.str();
+	}
+
+	std::string Generator::AwaitParams(const std::string& code, ASTPtr ast, const std::set<std::string>& shadowed)
+	{
+		// A let or loop variable of the same name hides the param
+		std::set<std::string> deferred;
+		for(ASTPtr l = ast; l; l = l->is_base_ast() ? nullptr : std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast())
+			for(auto& p : l->get_parameters())
+				if(p->is_deferred() && !shadowed.count(p->get_name())) deferred.insert(p->get_name());
+		if(deferred.empty()) return code;
+
+		// Every use of a deferred param reads its value, member names and literals are left alone
+		auto ident = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; };
+		std::string res;
+		size_t i = 0;
+		while(i < code.size()) {
+			char c = code[i];
+			if(c == '"' || c == '\'') {
+				size_t end = i + 1;
+				while(end < code.size() && code[end] != c) end += code[end] == '\\' ? 2 : 1;
+				end = std::min(end + 1, code.size());
+				res.append(code, i, end - i);
+				i = end;
+			} else if(ident(c)) {
+				size_t end = i;
+				while(end < code.size() && ident(code[end])) end++;
+				auto word = code.substr(i, end - i);
+				auto prev = res.find_last_not_of(" \t\r\n");
+				bool member = prev != std::string::npos && (res[prev] == '.' || (prev > 0 && (res.compare(prev - 1, 2, "->") == 0 || res.compare(prev - 1, 2, "::") == 0)));
+				res += word;
+				// Explicit get() calls are kept as they are
+				auto next = code.find_first_not_of(" \t\r\n", end);
+				bool awaited = next != std::string::npos && code.compare(next, 5, ".get(") == 0;
+				if(!member && !awaited && !std::isdigit(static_cast<unsigned char>(c)) && deferred.count(word)) res += ".get()";
+				i = end;
+			} else {
+				res += c;
+				i++;
+			}
+		}
+		return res;
+	}
+
+	std::string Generator::BuildVariablesBlock(ASTPtr ast, const GeneratorOptions& options, const std::string& indent)
+	{
+		// Pins the snapshot of the chain for the rest of the scope, params are bound as locals already and hide variables
+		if(!SnapshotLevel(ast, options)) return "";
+		std::string res;
+		res += indent + "variables_snapshot pinned_snapshot(*this);\n";
+		res += indent + "const variables& pinned_variables = static_cast<const variables&>(*pinned_snapshot);\n";
+		return res + BindVariables(ast, options, "pinned_variables", indent);
+	}
+
+	std::string Generator::BindVariables(ASTPtr ast, const GeneratorOptions& options, const std::string& snapshot, const std::string& indent)
+	{
+		// Names of the most derived template win, as they do in the snapshot
+		std::vector<ASTPtr> chain;
+		std::set<std::string> bound;
+		for(ASTPtr l = ast; l; l = l->is_base_ast() ? nullptr : std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast()) {
+			chain.push_back(l);
+			for(auto& p : l->get_parameters()) bound.insert(p->get_name());
+		}
+		std::string res;
+		for(auto& l : chain) {
+			for(auto& v : l->get_variables()) {
+				if(!bound.insert(v->get_name()).second) continue;
+				res += indent + "auto& " + v->get_name() + " = " + snapshot + "." + v->get_name() + "; (void)" + v->get_name() + ";\n";
+			}
+			// Named after their template, nothing hides them
+			for(auto& name : StaticMembers(l, options))
+				res += indent + "auto& " + name + " = " + snapshot + "." + name + "; (void)" + name + ";\n";
+		}
+		return res;
+	}
+
+	std::string Generator::StaticSection(ASTPtr ast, size_t index, const GeneratorOptions& options)
+	{
+		// The default locale goes without a suffix, the interpreter renders with it
+		auto res = "static_" + ast->get_classname() + "_" + std::to_string(index);
+		if(options.locale && options.locale != options.catalogs.front())
+			res += "_" + options.locale->get_identifier();
+		return res;
+	}
+
+	void Generator::CollectStatics(const std::vector<NodePtr>& nodes, std::vector<StaticNodePtr>& res)
+	{
+		for(auto& n : nodes) {
+			switch(n->get_type()) {
+				case NodeType::Static:
+					res.push_back(std::dynamic_pointer_cast<StaticNode>(n));
+					break;
+				case NodeType::ForEachLoop:
+					CollectStatics(std::dynamic_pointer_cast<ForEachLoopNode>(n)->get_nodes(), res);
+					break;
+				case NodeType::Let:
+					CollectStatics(std::dynamic_pointer_cast<LetNode>(n)->get_nodes(), res);
+					break;
+				case NodeType::Conditional: {
+					auto cn = std::dynamic_pointer_cast<ConditionNode>(n);
+					for(auto& b : cn->get_branches())
+						CollectStatics(b.second, res);
+					CollectStatics(cn->get_else_branch(), res);
+					break;
+				}
+				default: break;
+			}
+		}
+	}
+
+	void Generator::CollectBlockCalls(const std::vector<NodePtr>& nodes, std::vector<BlockCallNodePtr>& res)
+	{
+		// Blocks are called from the top level of a base only, which let bindings may have scoped
+		for(auto& n : nodes) {
+			if(n->get_type() == NodeType::BlockCall)
+				res.push_back(std::dynamic_pointer_cast<BlockCallNode>(n));
+			else if(n->get_type() == NodeType::Let)
+				CollectBlockCalls(std::dynamic_pointer_cast<LetNode>(n)->get_nodes(), res);
+		}
+	}
+
+	uint64_t Generator::StaticBytes(const std::vector<NodePtr>& nodes)
+	{
+		// Text appended whenever the nodes render, including that of let bindings scoping the rest
+		uint64_t res = 0;
+		for(auto& n : nodes) {
+			if(n->get_type() == NodeType::AppendString)
+				res += std::dynamic_pointer_cast<AppendStringNode>(n)->get_data().size();
+			else if(n->get_type() == NodeType::Let)
+				res += StaticBytes(std::dynamic_pointer_cast<LetNode>(n)->get_nodes());
+		}
+		return res;
+	}
+
+	uint64_t Generator::ProfiledLoopBytes(const std::vector<NodePtr>& nodes, ASTPtr ast, const GeneratorOptions& options)
+	{
+		// Static text appended by the loops among the nodes over all profiled renders, including loops nested in them
+		uint64_t res = 0;
+		for(auto& n : nodes) {
+			if(n->get_type() == NodeType::Let) {
+				res += ProfiledLoopBytes(std::dynamic_pointer_cast<LetNode>(n)->get_nodes(), ast, options);
+			} else if(n->get_type() == NodeType::ForEachLoop) {
+				auto& body = std::dynamic_pointer_cast<ForEachLoopNode>(n)->get_nodes();
+				res += options.profile->get(Profile::MakeKey(ast, n), 1) * StaticBytes(body) + ProfiledLoopBytes(body, ast, options);
+			}
+		}
+		return res;
+	}
+
+	std::vector<StaticNodePtr> Generator::StaticSections(ASTPtr ast)
+	{
+		// Sections of the template itself in the order they are numbered, bases store their own
+		std::vector<StaticNodePtr> res;
+		if(ast->is_base_ast())
+			CollectStatics(std::dynamic_pointer_cast<BaseTemplateAST>(ast)->get_nodes(), res);
+		for(auto& b : ast->get_blocks())
+			CollectStatics(b->get_nodes(), res);
+		std::sort(res.begin(), res.end(), [](const StaticNodePtr& a, const StaticNodePtr& b) { return a->get_index() < b->get_index(); });
+		return res;
+	}
+
+	bool Generator::ChainHasStatics(ASTPtr ast)
+	{
+		for(ASTPtr l = ast; l; l = l->is_base_ast() ? nullptr : std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast())
+			if(!StaticSections(l).empty()) return true;
+		return false;
+	}
+
+	std::vector<std::string> Generator::StaticMembers(ASTPtr ast, const GeneratorOptions& options)
+	{
+		// One stored text per section and locale
+		std::vector<std::string> res;
+		for(auto& s : StaticSections(ast)) {
+			auto opts = options;
+			for(size_t i = 0; i < std::max<size_t>(options.catalogs.size(), 1); i++) {
+				if(!options.catalogs.empty()) opts.locale = options.catalogs[i];
+				res.push_back(StaticSection(ast, s->get_index(), opts));
+			}
+		}
+		return res;
+	}
+
+	bool Generator::HasSnapshot(ASTPtr ast, const GeneratorOptions& options)
+	{
+		// Stored static sections have to change together with the variables they were rendered from
+		return options.atomic_variables && (!ast->get_variables().empty() || !StaticSections(ast).empty());
+	}
+
+	ASTPtr Generator::SnapshotLevel(ASTPtr ast, const GeneratorOptions& options)
+	{
+		// The chain shares one snapshot, each template extends the variables of the nearest base with some
+		for(ASTPtr l = ast; l; l = l->is_base_ast() ? nullptr : std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast())
+			if(HasSnapshot(l, options)) return l;
+		return nullptr;
+	}
+
+	std::string Generator::SnapshotType(ASTPtr ast, const GeneratorOptions& options)
+	{
+		// Variables of the template owning the snapshot, what the chain publishes and pins
+		ASTPtr owner;
+		for(ASTPtr l = ast; l; l = l->is_base_ast() ? nullptr : std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast())
+			if(HasSnapshot(l, options)) owner = l;
+		return "::" + owner->get_namespace() + "::" + owner->get_classname() + "::variables";
+	}
+
+	bool Generator::OwnsSnapshot(ASTPtr ast, const GeneratorOptions& options)
+	{
+		// The first template of the chain with a snapshot holds the pointer to it and publishes it
+		if(!HasSnapshot(ast, options)) return false;
+		return ast->is_base_ast() || !SnapshotLevel(std::dynamic_pointer_cast<ExtendingTemplateAST>(ast)->get_base_template_ast(), options);
+	}
+
+	bool Generator::ParallelNodes(const std::vector<NodePtr>& nodes)
+	{
+		for(auto& n : nodes) {
+			switch(n->get_type()) {
+				case NodeType::ForEachLoop: {
+					auto l = std::dynamic_pointer_cast<ForEachLoopNode>(n);
+					if(l->is_parallel() || ParallelNodes(l->get_nodes())) return true;
+					break;
+				}
+				case NodeType::Let:
+					if(ParallelNodes(std::dynamic_pointer_cast<LetNode>(n)->get_nodes())) return true;
+					break;
+				case NodeType::Static:
+					if(ParallelNodes(std::dynamic_pointer_cast<StaticNode>(n)->get_nodes())) return true;
+					break;
+				case NodeType::Conditional: {
+					auto cn = std::dynamic_pointer_cast<ConditionNode>(n);
+					for(auto& b : cn->get_branches())
+						if(ParallelNodes(b.second)) return true;
+					if(ParallelNodes(cn->get_else_branch())) return true;
+					break;
+				}
+				default: break;
+			}
+		}
+		return false;
+	}
+
+	bool Generator::OwnsExecutor(ASTPtr ast, const GeneratorOptions& options)
+	{
+		// Declared by the first template of the chain that renders anything on it, templates extending it inherit it
+		auto uses = [&](ASTPtr l) {
+			if(l->is_base_ast() && (options.batch || ParallelNodes(std::dynamic_pointer_cast<BaseTemplateAST>(l)->get_nodes()))) return true;
+			for(auto& b : l->get_blocks())
+				if(b->is_parallel() || ParallelNodes(b->get_nodes())) return true;
+			return false;
+		};
+		if(!uses(ast)) return false;
+		for(ASTPtr l = ast; !l->is_base_ast();) {
+			l = std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast();
+			if(uses(l)) return false;
+		}
+		return true;
+	}
+
+	bool Generator::OwnsDeferred(ASTPtr ast)
+	{
+		// lazy and async are declared by the first template of the chain with such a param, like the executor
+		auto uses = [](ASTPtr l) {
+			auto& params = l->get_parameters();
+			return std::any_of(params.begin(), params.end(), [](const ParameterPtr& p) { return p->is_deferred(); });
+		};
+		if(!uses(ast)) return false;
+		for(ASTPtr l = ast; !l->is_base_ast();) {
+			l = std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast();
+			if(uses(l)) return false;
+		}
+		return true;
+	}
+
 	std::string Generator::SanitizePlainText(const std::string& str)
 	{
+		// Copy runs without escapes at once, text of large templates is mostly such runs
 		std::string res;
-		for (auto& c : str)
+		res.reserve(str.size() + str.size() / 8);
+		size_t start = 0;
+		for (size_t i = 0; i < str.size(); i++)
 		{
-			switch (c) {
-			case '\'': res += "\\'"; break;
-			case '"': res += "\\\""; break;
-			case '\\': res += "\\\\"; break;
-			case '\n': res += "\\n"; break;
-			case '\r': res += "\\r"; break;
-			default: res += c;
+			const char* escaped;
+			switch (str[i]) {
+			case '\'': escaped = "\\'"; break;
+			case '"': escaped = "\\\""; break;
+			case '\\': escaped = "\\\\"; break;
+			case '\n': escaped = "\\n"; break;
+			case '\r': escaped = "\\r"; break;
+			default: continue;
 			}
+			res.append(str, start, i - start);
+			res += escaped;
+			start = i + 1;
 		}
+		res.append(str, start, std::string::npos);
 		return res;
 	}
 
@@ -108,77 +424,1037 @@ namespace cpptemplate {
 		return node;
 	}
 
-	std::string Generator::BuildActionRender(std::vector<NodePtr> nodes, ASTPtr ast, ASTPtr baseast, const std::string& cblock, size_t nindent)
+	std::string Generator::SanitizeBinary(const std::string& str)
 	{
-		std::string indent;
-		for(size_t i=0; i<nindent; i++) indent+="\t";
-		std::ostringstream impl;
+		std::string res;
+		for (auto& c : str)
+		{
+			auto u = static_cast<unsigned char>(c);
+			if (c == '"' || c == '\\' || c == '?' || u < 0x20 || u >= 0x7f) {
+				// Octal escapes end after three digits, unlike hex ones which would swallow following digits
+				char buf[5];
+				snprintf(buf, sizeof(buf), "\\%03o", u);
+				res += buf;
+			} else {
+				res += c;
+			}
+		}
+		return res;
+	}
+
+	std::string Generator::CompressLiteral(const std::string& str)
+	{
+		// Raw deflate of its own, ending on a byte boundary so it can be spliced into any stream
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+			throw std::runtime_error("failed to initialize zlib");
+		std::string res;
+		res.resize(deflateBound(&zs, str.size()) + 16);
+		zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(str.data()));
+		zs.avail_in = str.size();
+		zs.next_out = reinterpret_cast<Bytef*>(&res[0]);
+		zs.avail_out = res.size();
+		auto ret = deflate(&zs, Z_SYNC_FLUSH);
+		res.resize(res.size() - zs.avail_out);
+		deflateEnd(&zs);
+		if(ret != Z_OK || zs.avail_in != 0)
+			throw std::runtime_error("failed to compress literal");
+		return res;
+	}
+
+	std::string Generator::CompressGzip(const std::string& str)
+	{
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+			throw std::runtime_error("failed to initialize zlib");
+		std::string res;
+		res.resize(deflateBound(&zs, str.size()) + 32);
+		zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(str.data()));
+		zs.avail_in = str.size();
+		zs.next_out = reinterpret_cast<Bytef*>(&res[0]);
+		zs.avail_out = res.size();
+		auto ret = deflate(&zs, Z_FINISH);
+		res.resize(res.size() - zs.avail_out);
+		deflateEnd(&zs);
+		if(ret != Z_STREAM_END)
+			throw std::runtime_error("failed to compress text");
+		return res;
+	}
+
+	void Generator::HashLiteral(const std::string& str, uint32_t& crc, uint32_t& shift)
+	{
+		// Raw crc register starting from zero, the sink combines it with its own state
+		crc = 0;
+		for(auto c : str) {
+			crc ^= static_cast<unsigned char>(c);
+			for(int i = 0; i < 8; i++)
+				crc = crc & 1 ? (crc >> 1) ^ HASH_POLYNOMIAL : crc >> 1;
+		}
+		// x^(8 * size) mod the polynomial, advances a register over size bytes in one multiplication
+		auto multiply = [](uint32_t a, uint32_t b) {
+			uint32_t p = 0;
+			for(uint32_t m = 1u << 31; m; m >>= 1) {
+				if(a & m) p ^= b;
+				b = b & 1 ? (b >> 1) ^ HASH_POLYNOMIAL : b >> 1;
+			}
+			return p;
+		};
+		uint32_t base = 1u << 23; // x^8
+		shift = 1u << 31; // x^0
+		for(auto n = str.size(); n; n >>= 1) {
+			if(n & 1) shift = multiply(shift, base);
+			base = multiply(base, base);
+		}
+	}
+
+	std::vector<std::string> Generator::SinkTypes(const GeneratorOptions& options)
+	{
+		// Output types render code is generated for, std::string first
+		std::vector<std::string> res { "std::string" };
+		if(options.deflate) res.push_back("deflate_sink");
+		if(options.hash) res.push_back("hash_sink");
+		return res;
+	}
+
+	std::string Generator::BlobSymbol(ASTPtr ast)
+	{
+		// Assembler name of the blob, unique within a program like the class itself
+		std::string res = "cpptemplate_blob_";
+		for(auto& ns : split(ast->get_namespace(), "::"))
+			res += ns + "_";
+		return res + ast->get_classname();
+	}
+
+	std::string Generator::BuildLiteralData(const std::string& str, ASTPtr ast, const GeneratorOptions& options)
+	{
+		// Pointer to the text, large text goes into the blob once no matter how often it is used
+		if(!options.blob || options.blob_threshold == 0 || str.size() < options.blob_threshold)
+			return "\"" + SanitizePlainText(str) + "\"";
+		auto it = options.blob_literals->find(str);
+		if(it == options.blob_literals->end()) {
+			it = options.blob_literals->emplace(str, options.blob->size()).first;
+			options.blob->append(str);
+		}
+		return "reinterpret_cast<const char*>(" + ast->get_classname() + "_blob) + " + std::to_string(it->second);
+	}
+
+	std::string Generator::BlockFunction(const std::string& name, const GeneratorOptions& options)
+	{
+		if(!options.locale) return "renderBlock_" + name;
+		return "renderBlock_" + name + "_" + options.locale->get_identifier();
+	}
+
+	void Generator::CheckStaticText(const std::vector<NodePtr>& nodes, ASTPtr ast, const GeneratorOptions& options)
+	{
+		// Checked once here, so only expression output has to be validated while rendering
+		auto check = [&](const std::string& text, NodePtr node, const std::string& what) {
+			auto valid = valid_utf8_prefix(text);
+			if(valid != text.size())
+				throw std::runtime_error(what + " at " + ast->get_filename() + ":" + std::to_string(node->get_source_line()) + ":" + std::to_string(node->get_source_col())
+					+ " is not valid UTF-8 at byte " + std::to_string(valid));
+		};
+		for(auto& onode : nodes) {
+			auto node = ReplaceMacros(onode, ast);
+			switch(node->get_type()) {
+				case NodeType::AppendString:
+					check(std::dynamic_pointer_cast<AppendStringNode>(node)->get_data(), onode, "text");
+					break;
+				case NodeType::Translation:
+					for(auto& c : options.catalogs)
+						check(c->get(std::dynamic_pointer_cast<TranslationNode>(node)->get_key()), onode, "translation for " + c->get_identifier());
+					break;
+				case NodeType::ForEachLoop:
+					CheckStaticText(std::dynamic_pointer_cast<ForEachLoopNode>(node)->get_nodes(), ast, options);
+					break;
+				case NodeType::Let:
+					CheckStaticText(std::dynamic_pointer_cast<LetNode>(node)->get_nodes(), ast, options);
+					break;
+				case NodeType::Static:
+					CheckStaticText(std::dynamic_pointer_cast<StaticNode>(node)->get_nodes(), ast, options);
+					break;
+				case NodeType::Conditional: {
+					auto cn = std::dynamic_pointer_cast<ConditionNode>(node);
+					for(auto& b : cn->get_branches())
+						CheckStaticText(b.second, ast, options);
+					CheckStaticText(cn->get_else_branch(), ast, options);
+					break;
+				}
+				default: break;
+			}
+		}
+	}
+
+	std::vector<NodePtr> Generator::Localize(const std::vector<NodePtr>& nodes, ASTPtr ast, CatalogPtr catalog)
+	{
+		std::vector<NodePtr> res;
 		for(auto& onode : nodes) {
 			auto node = ReplaceMacros(onode, ast);
+			switch(node->get_type()) {
+				case NodeType::Translation:
+					node = std::make_shared<AppendStringNode>(catalog->get(std::dynamic_pointer_cast<TranslationNode>(node)->get_key()));
+					break;
+				case NodeType::ForEachLoop: {
+					auto l = std::dynamic_pointer_cast<ForEachLoopNode>(node);
+					auto copy = std::make_shared<ForEachLoopNode>(*l);
+					copy->set_nodes(Localize(l->get_nodes(), ast, catalog));
+					node = copy;
+					break;
+				}
+				case NodeType::Let: {
+					auto l = std::dynamic_pointer_cast<LetNode>(node);
+					auto copy = std::make_shared<LetNode>(*l);
+					copy->set_nodes(Localize(l->get_nodes(), ast, catalog));
+					node = copy;
+					break;
+				}
+				case NodeType::Conditional: {
+					auto cn = std::dynamic_pointer_cast<ConditionNode>(node);
+					auto copy = std::make_shared<ConditionNode>();
+					for(auto& b : cn->get_branches())
+						copy->add_branch(b.first, Localize(b.second, ast, catalog));
+					copy->set_else(Localize(cn->get_else_branch(), ast, catalog));
+					copy->set_source_location(cn->get_source_line(), cn->get_source_col());
+					node = copy;
+					break;
+				}
+				default: break;
+			}
+			// Fold translations and static macros into the surrounding text so each run is a single append
+			if(node->get_type() == NodeType::AppendString && !res.empty() && res.back()->get_type() == NodeType::AppendString) {
+				res.back() = std::make_shared<AppendStringNode>(std::dynamic_pointer_cast<AppendStringNode>(res.back())->get_data()
+					+ std::dynamic_pointer_cast<AppendStringNode>(node)->get_data());
+				continue;
+			}
+			res.push_back(node);
+		}
+		return res;
+	}
+
+	std::set<std::string> Generator::Identifiers(const std::string& code)
+	{
+		auto ident = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; };
+		std::set<std::string> res;
+		size_t i = 0;
+		while(i < code.size()) {
+			if(code[i] == '"' || code[i] == '\'') {
+				size_t end = i + 1;
+				while(end < code.size() && code[end] != code[i]) end += code[end] == '\\' ? 2 : 1;
+				i = end + 1;
+			} else if(ident(code[i])) {
+				size_t end = i;
+				while(end < code.size() && ident(code[end])) end++;
+				if(!std::isdigit(static_cast<unsigned char>(code[i]))) res.insert(code.substr(i, end - i));
+				i = end;
+			} else {
+				i++;
+			}
+		}
+		return res;
+	}
+
+	std::vector<NodePtr> Generator::ShareExpression(const std::vector<NodePtr>& nodes, const std::string& code, const std::string& name, size_t& count)
+	{
+		// Stops where a loop variable or binding shadows a name the expression uses
+		auto ids = Identifiers(code);
+		std::vector<NodePtr> res;
+		for(auto& node : nodes) {
+			switch(node->get_type()) {
+				case NodeType::Expression: {
+					auto e = std::dynamic_pointer_cast<ExpressionNode>(node);
+					if(!e->is_pure() || e->get_code() != code) break;
+					auto copy = std::make_shared<ExpressionNode>(name);
+					copy->set_source_location(e->get_source_line(), e->get_source_col());
+					res.push_back(copy);
+					count++;
+					continue;
+				}
+				case NodeType::ForEachLoop: {
+					auto l = std::dynamic_pointer_cast<ForEachLoopNode>(node);
+					if(ids.count(l->get_variable_name())) break;
+					auto copy = std::make_shared<ForEachLoopNode>(*l);
+					copy->set_nodes(ShareExpression(l->get_nodes(), code, name, count));
+					res.push_back(copy);
+					continue;
+				}
+				case NodeType::Let: {
+					auto l = std::dynamic_pointer_cast<LetNode>(node);
+					if(ids.count(l->get_name())) break;
+					auto copy = std::make_shared<LetNode>(*l);
+					copy->set_nodes(ShareExpression(l->get_nodes(), code, name, count));
+					res.push_back(copy);
+					continue;
+				}
+				case NodeType::Conditional: {
+					auto cn = std::dynamic_pointer_cast<ConditionNode>(node);
+					auto copy = std::make_shared<ConditionNode>();
+					for(auto& b : cn->get_branches())
+						copy->add_branch(b.first, ShareExpression(b.second, code, name, count));
+					copy->set_else(ShareExpression(cn->get_else_branch(), code, name, count));
+					copy->set_source_location(cn->get_source_line(), cn->get_source_col());
+					res.push_back(copy);
+					continue;
+				}
+				default: break;
+			}
+			res.push_back(node);
+		}
+		return res;
+	}
+
+	std::vector<NodePtr> Generator::ShareExpressions(const std::vector<NodePtr>& nodes)
+	{
+		// A pure expression used again later in the same scope is bound where it is first rendered.
+		// Only unconditional uses are bound, a use inside a branch must not be evaluated ahead of it.
+		for(size_t i = 0; i < nodes.size(); i++) {
+			if(nodes[i]->get_type() != NodeType::Expression) continue;
+			auto e = std::dynamic_pointer_cast<ExpressionNode>(nodes[i]);
+			if(!e->is_pure()) continue;
+			auto name = "pure_" + std::to_string(e->get_source_line()) + "_" + std::to_string(e->get_source_col());
+			size_t count = 0;
+			auto rest = ShareExpression(std::vector<NodePtr>(nodes.begin() + i, nodes.end()), e->get_code(), name, count);
+			if(count < 2) continue;
+			auto let = std::make_shared<LetNode>(name, e->get_code());
+			let->set_source_location(e->get_source_line(), e->get_source_col());
+			let->set_nodes(rest);
+			std::vector<NodePtr> res(nodes.begin(), nodes.begin() + i);
+			res.push_back(let);
+			return res;
+		}
+		return nodes;
+	}
+
+	std::vector<std::pair<std::string, std::string>> Generator::InvariantExpressions(const std::vector<NodePtr>& nodes, std::set<std::string> bound)
+	{
+		// Pure expressions rendered on every iteration that use no name bound by the loop
+		std::vector<std::pair<std::string, std::string>> res;
+		for(auto& node : nodes) {
+			if(node->get_type() == NodeType::Expression) {
+				auto e = std::dynamic_pointer_cast<ExpressionNode>(node);
+				if(!e->is_pure()) continue;
+				auto ids = Identifiers(e->get_code());
+				if(std::any_of(ids.begin(), ids.end(), [&](const std::string& id) { return bound.count(id) != 0; })) continue;
+				if(std::any_of(res.begin(), res.end(), [&](const std::pair<std::string, std::string>& h) { return h.first == e->get_code(); })) continue;
+				res.push_back({ e->get_code(), "pure_" + std::to_string(e->get_source_line()) + "_" + std::to_string(e->get_source_col()) });
+			} else if(node->get_type() == NodeType::Let) {
+				auto l = std::dynamic_pointer_cast<LetNode>(node);
+				auto inner = bound;
+				inner.insert(l->get_name());
+				for(auto& h : InvariantExpressions(l->get_nodes(), inner))
+					if(std::none_of(res.begin(), res.end(), [&](const std::pair<std::string, std::string>& e) { return e.first == h.first; }))
+						res.push_back(h);
+			}
+		}
+		return res;
+	}
+
+	bool Generator::PrerenderNodes(const std::vector<NodePtr>& nodes, ASTPtr ast, ASTPtr level, std::string& out)
+	{
+		// Blocks resolve like the virtual calls of render, starting at the most derived template
+		auto base_of = [](ASTPtr l) { return l->is_base_ast() ? nullptr : std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast(); };
+		for(auto& onode : nodes) {
+			auto node = ReplaceMacros(onode, level);
 			switch(node->get_type()) {
 				case NodeType::AppendString:
-					impl << indent << "str.append(\"" << SanitizePlainText(std::dynamic_pointer_cast<AppendStringNode>(node)->get_data()) << "\");" << std::endl;
+					out += std::dynamic_pointer_cast<AppendStringNode>(node)->get_data();
 					break;
 				case NodeType::BlockCall:
-					impl << indent << "renderBlock_" << std::dynamic_pointer_cast<BlockCallNode>(node)->get_block() << "(str, p);" << std::endl;
+				case NodeType::BlockParentCall: {
+					std::string name;
+					ASTPtr l;
+					if(node->get_type() == NodeType::BlockCall) {
+						name = std::dynamic_pointer_cast<BlockCallNode>(node)->get_block();
+						l = ast;
+					} else {
+						name = std::dynamic_pointer_cast<BlockParentCallNode>(node)->get_block();
+						l = base_of(level);
+					}
+					while(l && !l->get_block(name)) l = base_of(l);
+					if(!l || !PrerenderNodes(l->get_block(name)->get_nodes(), ast, l, out)) return false;
 					break;
+				}
+				default:
+					return false;
+			}
+		}
+		return true;
+	}
+
+	bool Generator::Prerender(ASTPtr ast, std::string& out)
+	{
+		// Code run around render could have effects a returned text would skip
+		ASTPtr root = ast;
+		while(true) {
+			if(root->get_codeblock("prerender") || root->get_codeblock("postrender")) return false;
+			if(root->is_base_ast()) break;
+			root = std::dynamic_pointer_cast<ExtendingTemplateAST>(root)->get_base_template_ast();
+		}
+		out.clear();
+		return PrerenderNodes(std::dynamic_pointer_cast<BaseTemplateAST>(root)->get_nodes(), ast, root, out);
+	}
+
+	bool Generator::PrerenderBlock(ASTPtr ast, const std::string& name, std::string& out)
+	{
+		auto block = ast->get_block(name);
+		out.clear();
+		return block && PrerenderNodes(block->get_nodes(), ast, ast, out);
+	}
+
+	std::string Generator::LineDirective(size_t line, ASTPtr ast)
+	{
+		// Written at once, the writer recognizes it at the start of a line
+		return "#line " + std::to_string(line) + " \"" + SanitizePlainText(ast->get_filename()) + "\"";
+	}
+
+	void Generator::BuildCodeBlock(CodeWriter& impl, CodeBlockPtr code, ASTPtr ast, const GeneratorOptions& options)
+	{
+		// Lines of code keep their own template line, the writer holds a directive for all lines following it
+		bool mapped = !options.line_directives.empty() && code->get_source_line() > 0;
+		std::istringstream iss(code->get_code());
+		std::string line;
+		for(size_t i = 0; std::getline(iss, line); i++) {
+			if(mapped)
+				impl << LineDirective(code->get_source_line() + i, ast) << std::endl;
+			impl << "\t" << line << std::endl;
+		}
+		if(mapped)
+			impl << CodeWriter::GENERATED_LINE << std::endl;
+	}
+
+	void Generator::BuildProbe(CodeWriter& impl, ASTPtr ast, NodePtr node, size_t index, size_t nindent)
+	{
+		if(index >= Profile::MAX_COUNTERS)
+			throw std::runtime_error("too many branches to instrument at " + ast->get_filename() + ":" + std::to_string(node->get_source_line()) + ":" + std::to_string(node->get_source_col()));
+		impl.indent(nindent);
+		impl << "{ static auto& probe = " << ast->get_classname() << "_profile::counter(\"" << Profile::MakeKey(ast, node) << "\", " << index << "); "
+			<< "probe.fetch_add(1, std::memory_order_relaxed); }" << std::endl;
+		impl.dedent(nindent);
+	}
+
+	void Generator::BuildBranch(CodeWriter& impl, std::vector<NodePtr> nodes, ASTPtr ast, ASTPtr baseast, const GeneratorOptions& options, const std::string& cblock, size_t nindent, bool cold)
+	{
+		if(!cold) {
+			BuildActionRender(impl, nodes, ast, baseast, options, cblock, nindent);
+			return;
+		}
+		// Keep rarely taken code out of the hot function
+		impl.indent(nindent);
+		impl << "[&]() __attribute__((noinline, cold)) {" << std::endl;
+		BuildActionRender(impl, nodes, ast, baseast, options, cblock, 1);
+		impl << "}();" << std::endl;
+		impl.dedent(nindent);
+	}
+
+	size_t Generator::Statements(NodePtr node, const GeneratorOptions& options)
+	{
+		// Roughly the statements the node generates, counted once per node while splitting
+		if(options.statements) {
+			auto it = options.statements->find(node);
+			if(it != options.statements->end()) return it->second;
+		}
+		auto body = [&](const std::vector<NodePtr>& nodes) {
+			size_t res = 0;
+			for(auto& n : nodes) res += Statements(n, options);
+			return res;
+		};
+		size_t res = 1;
+		switch(node->get_type()) {
+			case NodeType::ForEachLoop: {
+				// Parallel loops generate their body twice, for the chunks and the serial fallback
+				auto l = std::dynamic_pointer_cast<ForEachLoopNode>(node);
+				res = 2 + body(l->get_nodes());
+				if(l->is_parallel()) res = 2 * res + 16;
+				break;
+			}
+			case NodeType::Conditional: {
+				auto cn = std::dynamic_pointer_cast<ConditionNode>(node);
+				for(auto& b : cn->get_branches())
+					res += 1 + body(b.second);
+				res += 1 + body(cn->get_else_branch());
+				break;
+			}
+			case NodeType::Let:
+				res = 4 + body(std::dynamic_pointer_cast<LetNode>(node)->get_nodes());
+				break;
+			default: break;
+		}
+		if(options.statements)
+			options.statements->emplace(node, res);
+		return res;
+	}
+
+	void Generator::BuildActionRender(CodeWriter& impl, std::vector<NodePtr> nodes, ASTPtr ast, ASTPtr baseast, const GeneratorOptions& options, const std::string& cblock, size_t nindent)
+	{
+		nodes = ShareExpressions(nodes);
+		// Levels are relative to the writer, it already holds the indentation of the enclosing code
+		impl.indent(nindent);
+		if(options.split_budget > 0 && nodes.size() > 1) {
+			std::vector<size_t> sizes;
+			size_t total = 0;
+			for(auto& n : nodes) {
+				sizes.push_back(Statements(n, options));
+				total += sizes.back();
+			}
+			if(total > options.split_budget) {
+				// Optimizer passes scale badly with function size, so outline runs of nodes up to the budget.
+				// A single node above the budget stays inline, its own body is split when it is generated.
+				for(size_t begin = 0; begin < nodes.size();) {
+					size_t end = begin + 1;
+					size_t size = sizes[begin];
+					while(end < nodes.size() && size + sizes[end] <= options.split_budget) size += sizes[end++];
+					std::vector<NodePtr> run(nodes.begin() + begin, nodes.begin() + end);
+					if(run.size() == 1) {
+						BuildActionRender(impl, run, ast, baseast, options, cblock);
+					} else {
+						impl << "[&]() __attribute__((noinline)) {" << std::endl;
+						BuildActionRender(impl, run, ast, baseast, options, cblock, 1);
+						impl << "}();" << std::endl;
+					}
+					begin = end;
+				}
+				impl.dedent(nindent);
+				return;
+			}
+		}
+		// Statements point at the template line they come from, code without one at the generated file again.
+		// Nested code returns to the generated file when it ends, so a line is only known to be in effect until then.
+		size_t mapped = 0;
+		for(auto& onode : nodes) {
+			auto node = ReplaceMacros(onode, ast);
+			if(!options.line_directives.empty()) {
+				if(onode->get_source_line() > 0 && onode->get_source_line() != mapped) {
+					impl << LineDirective(onode->get_source_line(), ast) << std::endl;
+					mapped = onode->get_source_line();
+				} else if(onode->get_source_line() == 0 && mapped) {
+					impl << CodeWriter::GENERATED_LINE << std::endl;
+					mapped = 0;
+				}
+				if(node->get_type() == NodeType::ForEachLoop || node->get_type() == NodeType::Conditional || node->get_type() == NodeType::Let)
+					mapped = 0;
+			}
+			switch(node->get_type()) {
+				case NodeType::AppendString: {
+					auto& data = std::dynamic_pointer_cast<AppendStringNode>(node)->get_data();
+					if(options.sink == "deflate_sink" && data.size() >= DEFLATE_MIN_LITERAL && CompressLiteral(data).size() * 2 <= data.size()) {
+						auto idx = options.deflate_literals->emplace(data, options.deflate_literals->size()).first->second;
+						impl << "str.literal(deflate_literals[" << idx << "]);" << std::endl;
+					} else if(options.sink == "hash_sink" && data.size() >= HASH_MIN_LITERAL) {
+						auto idx = options.hash_literals->emplace(data, options.hash_literals->size()).first->second;
+						impl << "str.literal(hash_literals[" << idx << "]);" << std::endl;
+					} else if(options.blob && options.blob_threshold > 0 && data.size() >= options.blob_threshold) {
+						impl << "str.append(" << BuildLiteralData(data, ast, options) << ", " << data.size() << ");" << std::endl;
+					} else {
+						impl << "str.append(\"" << SanitizePlainText(data) << "\");" << std::endl;
+					}
+					break;
+				}
+				case NodeType::BlockCall: {
+					auto& name = std::dynamic_pointer_cast<BlockCallNode>(node)->get_block();
+					auto block = ast->get_block(name);
+					if(block && block->is_parallel() && options.sink.empty()) {
+						// Already dispatched at the start of render, wait for it and splice in its buffer
+						impl << "tasks.get(block_task_" << name << ");" << std::endl;
+						impl << "str.append(block_buffer_" << name << ");" << std::endl;
+					} else {
+						impl << BlockFunction(name, options) << "(str, p);" << std::endl;
+					}
+					break;
+				}
 				case NodeType::BlockParentCall:
-					impl << indent << baseast->get_classname() << "::renderBlock_" << std::dynamic_pointer_cast<BlockParentCallNode>(node)->get_block() << "(str, p);" << std::endl;
+					impl << baseast->get_classname() << "::" << BlockFunction(std::dynamic_pointer_cast<BlockParentCallNode>(node)->get_block(), options) << "(str, p);" << std::endl;
+					break;
+				case NodeType::Translation:
+					if(!options.locale)
+						throw std::runtime_error("translating " + std::dynamic_pointer_cast<TranslationNode>(node)->get_key() + " requires a catalog");
+					impl << "str.append(\"" << SanitizePlainText(options.locale->get(std::dynamic_pointer_cast<TranslationNode>(node)->get_key())) << "\");" << std::endl;
 					break;
 				case NodeType::Expression:
-					impl << indent << "str.append(" << std::dynamic_pointer_cast<ExpressionNode>(node)->get_code() << ");" << std::endl;
+					if(!options.utf8.empty())
+						impl << "str.append(valid_utf8(" << AwaitParams(std::dynamic_pointer_cast<ExpressionNode>(node)->get_code(), ast, options.scoped) << "));" << std::endl;
+					else
+						impl << "str.append(" << AwaitParams(std::dynamic_pointer_cast<ExpressionNode>(node)->get_code(), ast, options.scoped) << ");" << std::endl;
 					break;
 				case NodeType::ForEachLoop: {
 					auto l = std::dynamic_pointer_cast<ForEachLoopNode>(node);
-					impl << indent << "for(auto& " << l->get_variable_name() << " : " << l->get_source() << ") {" << std::endl;
-					impl << BuildActionRender(l->get_nodes(), ast, baseast, cblock, nindent + 1);
-					impl << indent << "}" << std::endl;
+					auto hoisted = InvariantExpressions(l->get_nodes(), { l->get_variable_name() });
+					if(!hoisted.empty()) {
+						// Evaluated once ahead of the loop, but only if it runs at all
+						auto copy = std::make_shared<ForEachLoopNode>(*l);
+						copy->set_source("hoisted_source");
+						auto body = l->get_nodes();
+						impl << "{" << std::endl;
+						impl << "\tauto&& hoisted_source = " << AwaitParams(l->get_source(), ast, options.scoped) << ";" << std::endl;
+						impl << "\tif(std::begin(hoisted_source) != std::end(hoisted_source)) {" << std::endl;
+						for(auto& h : hoisted) {
+							size_t count = 0;
+							body = ShareExpression(body, h.first, h.second, count);
+							impl << "\t\tauto&& " << h.second << " = (" << AwaitParams(h.first, ast, options.scoped) << ");" << std::endl;
+						}
+						copy->set_nodes(body);
+						BuildActionRender(impl, { copy }, ast, baseast, options, cblock, 2);
+						impl << "\t}" << std::endl;
+						impl << "}" << std::endl;
+						break;
+					}
+					auto key = Profile::MakeKey(ast, node);
+					if(options.instrument)
+						BuildProbe(impl, ast, node, 0);
+					GeneratorOptions loop_options = options;
+					loop_options.in_loop = true;
+					loop_options.scoped.insert(l->get_variable_name());
+					// Sinks other than a string have no buffers to render chunks into
+					if(!l->is_parallel() || !options.sink.empty()) {
+						if(options.sink.empty() && !options.in_loop && options.profile && options.profile->get(key, 0) > 0 && options.profile->get(key, 1) >= PROFILE_MIN_SAMPLES) {
+							// Reserve the static part of the average trip count up front, nested loops included. Only the outermost
+							// loop does, a nested one would reserve on every iteration of it and exact-fit growth turns that quadratic.
+							auto expected = ProfiledLoopBytes({ node }, ast, options) / options.profile->get(key, 0);
+							if(expected >= PROFILE_MIN_RESERVE)
+								impl << "str.reserve(str.size() + " << expected << ");" << std::endl;
+						}
+						impl << "for(auto& " << l->get_variable_name() << " : " << AwaitParams(l->get_source(), ast, options.scoped) << ") {" << std::endl;
+						if(options.instrument)
+							BuildProbe(impl, ast, node, 1, 1);
+						BuildActionRender(impl, l->get_nodes(), ast, baseast, loop_options, cblock, 1);
+						impl << "}" << std::endl;
+						break;
+					}
+					// Split the range into chunks of grain elements. The first one renders straight into str while the
+					// others render into their own buffers, waiting on a chunk runs it here if no worker started it yet,
+					// so a loop nested in a parallel block or loop never waits on work queued behind itself.
+					// Small ranges or a missing executor fall back to the plain loop.
+					auto grain = std::to_string(l->get_grain());
+					impl << "{" << std::endl;
+					impl << "\tauto&& loop_source = " << AwaitParams(l->get_source(), ast, options.scoped) << ";" << std::endl;
+					impl << "\tconst size_t loop_size = static_cast<size_t>(std::end(loop_source) - std::begin(loop_source));" << std::endl;
+					impl << "\tif(executor && loop_size > " << grain << ") {" << std::endl;
+					impl << "\t\tconst size_t loop_chunks = (loop_size + " << grain << " - 1) / " << grain << ";" << std::endl;
+					impl << "\t\tauto loop_chunk = [&](std::string& str, size_t chunk) {" << std::endl;
+					impl << "\t\t\tauto first = std::begin(loop_source) + chunk * " << grain << ";" << std::endl;
+					impl << "\t\t\tauto last = chunk + 1 == loop_chunks ? std::end(loop_source) : first + " << grain << ";" << std::endl;
+					impl << "\t\t\tfor(auto it = first; it != last; ++it) {" << std::endl;
+					impl << "\t\t\t\tauto& " << l->get_variable_name() << " = *it;" << std::endl;
+					if(options.instrument)
+						BuildProbe(impl, ast, node, 1, 4);
+					BuildActionRender(impl, l->get_nodes(), ast, baseast, loop_options, cblock, 4);
+					impl << "\t\t\t}" << std::endl;
+					impl << "\t\t};" << std::endl;
+					impl << "\t\tstd::vector<std::string> loop_buffers(loop_chunks);" << std::endl;
+					impl << "\t\trender_tasks loop_tasks(executor);" << std::endl;
+					impl << "\t\tfor(size_t chunk = 1; chunk < loop_chunks; chunk++)" << std::endl;
+					impl << "\t\t\tloop_tasks.run([&, chunk]() { " << (options.pinned ? "variables_snapshot task_snapshot(&pinned_snapshot); " : "") << "loop_chunk(loop_buffers[chunk], chunk); });" << std::endl;
+					impl << "\t\tloop_chunk(str, 0);" << std::endl;
+					impl << "\t\tfor(size_t chunk = 1; chunk < loop_chunks; chunk++) {" << std::endl;
+					impl << "\t\t\tloop_tasks.get(chunk - 1);" << std::endl;
+					impl << "\t\t\tstr.append(loop_buffers[chunk]);" << std::endl;
+					impl << "\t\t}" << std::endl;
+					impl << "\t} else {" << std::endl;
+					impl << "\t\tfor(auto& " << l->get_variable_name() << " : loop_source) {" << std::endl;
+					if(options.instrument)
+						BuildProbe(impl, ast, node, 1, 3);
+					BuildActionRender(impl, l->get_nodes(), ast, baseast, loop_options, cblock, 3);
+					impl << "\t\t}" << std::endl;
+					impl << "\t}" << std::endl;
+					impl << "}" << std::endl;
 					break;
 				}
 				case NodeType::Conditional: {
 					auto cn = std::dynamic_pointer_cast<ConditionNode>(node);
 					auto& branches = cn->get_branches();
+					auto key = Profile::MakeKey(ast, node);
+					// Number of times we reached the current branch, counters are one per branch followed by the else branch
+					uint64_t reached = 0;
+					if(options.profile) {
+						for(size_t i = 0; i <= branches.size(); i++)
+							reached += options.profile->get(key, i);
+					}
+					bool use_profile = reached >= PROFILE_MIN_SAMPLES;
 					for(size_t i = 0; i< branches.size(); i++) {
-						if(i != 0) impl << indent << "else ";
-						else impl << indent;
-						impl << "if (" << branches[i].first << ") {" << std::endl;
-						impl << BuildActionRender(branches[i].second, ast, baseast, cblock, nindent + 1);
-						impl << indent << "}";
+						auto cond = AwaitParams(branches[i].first, ast, options.scoped);
+						// Chained onto the brace closing the previous branch
+						if(i != 0) impl << " else ";
+						bool cold = false;
+						if(use_profile) {
+							auto taken = options.profile->get(key, i);
+							double probability = reached == 0 ? 0.0 : double(taken) / reached;
+							if(probability >= PROFILE_LIKELY)
+								impl << "if (__builtin_expect(!!(" << cond << "), 1)) {" << std::endl;
+							else if(probability <= 1.0 - PROFILE_LIKELY)
+								impl << "if (__builtin_expect(!!(" << cond << "), 0)) {" << std::endl;
+							else
+								impl << "if (" << cond << ") {" << std::endl;
+							cold = probability < PROFILE_COLD;
+							reached -= taken;
+						} else {
+							impl << "if (" << cond << ") {" << std::endl;
+						}
+						if(options.instrument)
+							BuildProbe(impl, ast, node, i, 1);
+						BuildBranch(impl, branches[i].second, ast, baseast, options, cblock, 1, cold);
+						impl << "}";
 					}
 					auto belse = cn->get_else_branch();
-					if(!belse.empty()) {
+					if(!belse.empty() || options.instrument) {
+						bool cold = use_profile && (reached == 0 || double(options.profile->get(key, branches.size())) / reached < PROFILE_COLD);
 						impl << " else {" << std::endl;
-						impl << BuildActionRender(belse, ast, baseast, cblock, nindent + 1);
-						impl << indent << "}";
+						if(options.instrument)
+							BuildProbe(impl, ast, node, branches.size(), 1);
+						BuildBranch(impl, belse, ast, baseast, options, cblock, 1, cold);
+						impl << "}";
 					}
 					impl << std::endl;
 					break;
 				}
+				case NodeType::Static:
+					impl << "str.append(" << StaticSection(ast, std::dynamic_pointer_cast<StaticNode>(node)->get_index(), options) << ");" << std::endl;
+					break;
+				case NodeType::Let: {
+					auto l = std::dynamic_pointer_cast<LetNode>(node);
+					// The value is bound first, so it may use an outer name it shadows
+					impl << "{" << std::endl;
+					impl << "\tauto&& let_" << l->get_name() << " = " << AwaitParams(l->get_code(), ast, options.scoped) << ";" << std::endl;
+					impl << "\tauto&& " << l->get_name() << " = let_" << l->get_name() << "; (void)" << l->get_name() << ";" << std::endl;
+					GeneratorOptions let_options = options;
+					let_options.scoped.insert(l->get_name());
+					BuildActionRender(impl, l->get_nodes(), ast, baseast, let_options, cblock, 1);
+					impl << "}" << std::endl;
+					break;
+				}
+			}
+		}
+		if(mapped)
+			impl << CodeWriter::GENERATED_LINE << std::endl;
+		impl.dedent(nindent);
+	}
+
+	std::string Generator::BuildJsonReader(ASTPtr ast)
+	{
+		const static std::string TAB = "\t";
+		auto cls = ast->get_classname();
+		std::ostringstream impl;
+
+		// Reads values straight into their fields, strings without escapes are copied once from the input
+		impl << "class " << cls << R"(::json_reader
+{
+	const char* begin;
+	const char* pos;
+	const char* end;
+	std::string scratch {};
+
+	uint32_t hex4() {
+		if(end - pos < 4) fail("truncated escape");
+		uint32_t v = 0;
+		for(int i = 0; i < 4; i++) {
+			char c = *pos++;
+			v <<= 4;
+			if(c >= '0' && c <= '9') v |= c - '0';
+			else if(c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+			else if(c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+			else fail("invalid escape");
+		}
+		return v;
+	}
+	void utf8(uint32_t cp) {
+		if(cp < 0x80) {
+			scratch += static_cast<char>(cp);
+		} else if(cp < 0x800) {
+			scratch += static_cast<char>(0xc0 | (cp >> 6));
+			scratch += static_cast<char>(0x80 | (cp & 0x3f));
+		} else if(cp < 0x10000) {
+			scratch += static_cast<char>(0xe0 | (cp >> 12));
+			scratch += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+			scratch += static_cast<char>(0x80 | (cp & 0x3f));
+		} else {
+			scratch += static_cast<char>(0xf0 | (cp >> 18));
+			scratch += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+			scratch += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+			scratch += static_cast<char>(0x80 | (cp & 0x3f));
+		}
+	}
+public:
+	explicit json_reader(std::string_view json) : begin(json.data()), pos(json.data()), end(json.data() + json.size()) {}
+	json_reader(const json_reader&) = delete;
+	json_reader& operator=(const json_reader&) = delete;
+
+	[[noreturn]] void fail(const char* what) const {
+		throw std::invalid_argument(std::string("invalid json: ") + what + " at offset " + std::to_string(pos - begin));
+	}
+	void ws() {
+		while(pos != end && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r')) pos++;
+	}
+	bool consume(char c) {
+		ws();
+		if(pos == end || *pos != c) return false;
+		pos++;
+		return true;
+	}
+	void expect(char c) {
+		if(!consume(c)) fail("unexpected character");
+	}
+	bool literal(const char* lit, size_t len) {
+		ws();
+		if(static_cast<size_t>(end - pos) < len || memcmp(pos, lit, len) != 0) return false;
+		pos += len;
+		return true;
+	}
+	void finish() {
+		ws();
+		if(pos != end) fail("trailing characters");
+	}
+
+	// Points into the input unless the string contains escapes, valid until the next call
+	std::string_view string() {
+		expect('"');
+		auto start = pos;
+		while(pos != end && *pos != '"' && *pos != '\\') {
+			if(static_cast<unsigned char>(*pos) < 0x20) fail("control character in string");
+			pos++;
+		}
+		if(pos == end) fail("unterminated string");
+		if(*pos == '"') return std::string_view(start, pos++ - start);
+		scratch.assign(start, pos);
+		while(true) {
+			if(pos == end) fail("unterminated string");
+			char c = *pos++;
+			if(c == '"') return scratch;
+			if(static_cast<unsigned char>(c) < 0x20) fail("control character in string");
+			if(c != '\\') {
+				scratch += c;
+				continue;
+			}
+			if(pos == end) fail("unterminated string");
+			switch(*pos++) {
+				case '"': scratch += '"'; break;
+				case '\\': scratch += '\\'; break;
+				case '/': scratch += '/'; break;
+				case 'b': scratch += '\b'; break;
+				case 'f': scratch += '\f'; break;
+				case 'n': scratch += '\n'; break;
+				case 'r': scratch += '\r'; break;
+				case 't': scratch += '\t'; break;
+				case 'u': {
+					uint32_t cp = hex4();
+					if(cp >= 0xd800 && cp < 0xdc00) {
+						if(end - pos < 2 || pos[0] != '\\' || pos[1] != 'u') fail("unpaired surrogate");
+						pos += 2;
+						uint32_t low = hex4();
+						if(low < 0xdc00 || low >= 0xe000) fail("unpaired surrogate");
+						cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+					} else if(cp >= 0xdc00 && cp < 0xe000) {
+						fail("unpaired surrogate");
+					}
+					utf8(cp);
+					break;
+				}
+				default: fail("invalid escape");
+			}
+		}
+	}
+
+	// Skips the value of a field we do not know
+	void skip() {
+		ws();
+		if(pos == end) fail("unexpected end");
+		if(*pos == '"') {
+			string();
+		} else if(consume('{')) {
+			if(consume('}')) return;
+			do {
+				string();
+				expect(':');
+				skip();
+			} while(consume(','));
+			expect('}');
+		} else if(consume('[')) {
+			if(consume(']')) return;
+			do skip(); while(consume(','));
+			expect(']');
+		} else {
+			auto start = pos;
+			while(pos != end && ((*pos >= '0' && *pos <= '9') || (*pos >= 'a' && *pos <= 'z') || *pos == '-' || *pos == '+' || *pos == '.' || *pos == 'E')) pos++;
+			if(pos == start) fail("unexpected character");
+		}
+	}
+
+	template<typename F>
+	void object(F&& field) {
+		expect('{');
+		if(consume('}')) return;
+		do {
+			auto key = string();
+			expect(':');
+			field(key);
+		} while(consume(','));
+		expect('}');
+	}
+
+	void read(std::string& v) {
+		v = string();
+	}
+	void read(bool& v) {
+		if(literal("true", 4)) v = true;
+		else if(literal("false", 5)) v = false;
+		else fail("expected a boolean");
+	}
+	template<typename T>
+	std::enable_if_t<std::is_arithmetic<T>::value> read(T& v) {
+		ws();
+		auto res = std::from_chars(pos, end, v);
+		if(res.ec != std::errc()) fail("expected a number");
+		pos = res.ptr;
+	}
+	template<typename T, typename A>
+	void read(std::vector<T, A>& v) {
+		v.clear();
+		expect('[');
+		if(consume(']')) return;
+		do {
+			v.emplace_back();
+			value(v.back());
+		} while(consume(','));
+		expect(']');
+	}
+	template<typename T, typename C, typename A>
+	void read(std::map<std::string, T, C, A>& v) {
+		v.clear();
+		object([&](std::string_view key) { value(v[std::string(key)]); });
+	}
+	// null resets a field to its default
+	template<typename T>
+	void value(T& v) {
+		if(literal("null", 4)) v = T();
+		else read(v);
+	}
+};
+)" << std::endl;
+
+		std::vector<ParameterPtr> params;
+		std::vector<ASTPtr> chain;
+		for(ASTPtr l = ast; l; l = l->is_base_ast() ? nullptr : std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast())
+			chain.insert(chain.begin(), l);
+		// Deferred params are set from code, their keys are skipped like unknown ones
+		for(auto& l : chain)
+			for(auto& p : l->get_parameters())
+				if(!p->is_deferred()) params.push_back(p);
+		// Dispatch on the key length first, most keys are rejected without a compare
+		std::map<size_t, std::vector<ParameterPtr>> by_length;
+		for(auto& p : params)
+			by_length[p->get_name().size()].push_back(p);
+
+		impl << "void " << cls << "::from_json(std::string_view json, params& p)" << std::endl;
+		impl << "{" << std::endl;
+		impl << TAB << "json_reader r(json);" << std::endl;
+		impl << TAB << "r.object([&](std::string_view key) {" << std::endl;
+		if(!by_length.empty()) {
+			impl << TAB << TAB << "switch(key.size()) {" << std::endl;
+			for(auto& e : by_length) {
+				impl << TAB << TAB << TAB << "case " << e.first << ":" << std::endl;
+				for(auto& param : e.second) {
+					impl << TAB << TAB << TAB << TAB << "if(key == \"" << param->get_name() << "\") {" << std::endl;
+					impl << TAB << TAB << TAB << TAB << TAB << "r.value(p." << param->get_name() << ");" << std::endl;
+					impl << TAB << TAB << TAB << TAB << TAB << "return;" << std::endl;
+					impl << TAB << TAB << TAB << TAB << "}" << std::endl;
+				}
+				impl << TAB << TAB << TAB << TAB << "break;" << std::endl;
 			}
+			impl << TAB << TAB << "}" << std::endl;
 		}
+		impl << TAB << TAB << "r.skip();" << std::endl;
+		impl << TAB << "});" << std::endl;
+		impl << TAB << "r.finish();" << std::endl;
+		impl << "}" << std::endl;
+		impl << std::endl;
+		return impl.str();
+	}
+
+	std::string Generator::GenerateImplementation(ASTPtr ast, const GeneratorOptions& options)
+	{
+		std::ostringstream impl;
+		GenerateImplementation(impl, ast, options);
 		return impl.str();
 	}
 
-	std::string Generator::GenerateImplementation(ASTPtr ast)
+	void Generator::GenerateImplementation(std::ostream& out, ASTPtr ast, const GeneratorOptions& generator_options)
 	{
+		auto options = generator_options;
+		if(options.deflate)
+			options.deflate_literals = std::make_shared<std::map<std::string, size_t>>();
+		if(options.hash)
+			options.hash_literals = std::make_shared<std::map<std::string, size_t>>();
+		if(options.split_budget > 0)
+			options.statements = std::make_shared<std::map<NodePtr, size_t>>();
+		if(options.blob) {
+			options.blob->clear();
+			options.blob_literals = std::make_shared<std::map<std::string, size_t>>();
+		}
+
 		ASTPtr baseast;
 		if(!ast->is_base_ast())
 			baseast = std::dynamic_pointer_cast<ExtendingTemplateAST>(ast)->get_base_template_ast();
+		if(!options.utf8.empty()) {
+			if(ast->is_base_ast())
+				CheckStaticText(std::dynamic_pointer_cast<BaseTemplateAST>(ast)->get_nodes(), ast, options);
+			for(auto& b : ast->get_blocks())
+				CheckStaticText(b->get_nodes(), ast, options);
+		}
 
 		const static std::string TAB = "\t";
 
 		std::string line;
-		std::ostringstream impl;
+		CodeWriter impl(out, options.line_directives);
 
-		impl << "#include \"" << ast->get_classname() << ".h\"" << std::endl;
+		impl << "#include \"" << ast->get_classname() << (options.lean_header ? "_params.h" : ".h") << "\"" << std::endl;
 		for(auto& s : ast->get_implementation_includes()) {
 			impl << "#include " << s << std::endl;
 		}
 		if(ast->is_base_ast()) {
 			impl << "#include <chrono>" << std::endl;
+			impl << "#include <memory>" << std::endl;
 			impl << "#include <stdexcept>" << std::endl;
+		} else if(OwnsExecutor(ast, options)) {
+			impl << "#include <memory>" << std::endl;
 		}
 		impl << "#include <typeinfo>" << std::endl;
+		if(OwnsSnapshot(ast, options))
+			impl << "#include <thread>" << std::endl;
+		if(options.batch) {
+			if(ast->is_base_ast()) {
+				impl << "#include <algorithm>" << std::endl;
+				impl << "#include <thread>" << std::endl;
+			}
+			impl << "#include <stdexcept>" << std::endl;
+		}
+		if(options.json) {
+			impl << "#include <charconv>" << std::endl;
+			impl << "#include <cstring>" << std::endl;
+			impl << "#include <map>" << std::endl;
+			impl << "#include <stdexcept>" << std::endl;
+			impl << "#include <vector>" << std::endl;
+		}
+		if(options.deflate && ast->is_base_ast()) {
+			impl << "#include <cstring>" << std::endl;
+			impl << "#include <zlib.h>" << std::endl;
+		}
+		if(options.hash && ast->is_base_ast()) {
+			impl << "#include <array>" << std::endl;
+			impl << "#include <cstring>" << std::endl;
+			impl << "#ifdef __SSE4_2__" << std::endl;
+			impl << "#include <nmmintrin.h>" << std::endl;
+			impl << "#endif" << std::endl;
+		}
+		if(!options.utf8.empty() && ast->is_base_ast()) {
+			impl << "#include <stdexcept>" << std::endl;
+			impl << "#ifdef __SSE2__" << std::endl;
+			impl << "#include <emmintrin.h>" << std::endl;
+			impl << "#endif" << std::endl;
+		}
+		if(options.instrument) {
+			impl << "#include <atomic>" << std::endl;
+			impl << "#include <cstdlib>" << std::endl;
+			impl << "#include <deque>" << std::endl;
+			impl << "#include <fstream>" << std::endl;
+			impl << "#include <mutex>" << std::endl;
+		}
 
 		for(auto& ns : split(ast->get_namespace(), "::"))
 		{
@@ -187,14 +1463,75 @@ namespace cpptemplate {
 
 		impl << std::endl;
 
+		if(options.blob) {
+			// Defined at the end once we know the content, the asm label has to be on the first declaration
+			impl << "#if defined(__has_embed)" << std::endl;
+			impl << "extern const unsigned char " << ast->get_classname() << "_blob[];" << std::endl;
+			impl << "#else" << std::endl;
+			impl << "extern const unsigned char " << ast->get_classname() << "_blob[] __asm__(\"" << BlobSymbol(ast) << "\");" << std::endl;
+			impl << "#endif" << std::endl;
+			impl << std::endl;
+		}
+
+		if(options.instrument) {
+			// Counters live until exit and are appended to the profile file in the destructor
+			auto name = ast->get_classname() + "_profile";
+			impl << "namespace {" << std::endl;
+			impl << "struct " << name << "_counter" << std::endl;
+			impl << "{" << std::endl;
+			impl << TAB << "const char* key;" << std::endl;
+			impl << TAB << "size_t index;" << std::endl;
+			impl << TAB << "std::atomic<uint64_t> hits;" << std::endl;
+			impl << TAB << name << "_counter(const char* k, size_t i) : key(k), index(i), hits(0) {}" << std::endl;
+			impl << "};" << std::endl;
+			impl << std::endl;
+			impl << "class " << name << std::endl;
+			impl << "{" << std::endl;
+			impl << TAB << "std::mutex lck {};" << std::endl;
+			impl << TAB << "std::deque<" << name << "_counter> counters {};" << std::endl;
+			impl << "public:" << std::endl;
+			impl << TAB << "static std::atomic<uint64_t>& counter(const char* key, size_t index) {" << std::endl;
+			impl << TAB << TAB << "static " << name << " instance;" << std::endl;
+			impl << TAB << TAB << "std::lock_guard<std::mutex> guard(instance.lck);" << std::endl;
+			impl << TAB << TAB << "instance.counters.emplace_back(key, index);" << std::endl;
+			impl << TAB << TAB << "return instance.counters.back().hits;" << std::endl;
+			impl << TAB << "}" << std::endl;
+			impl << TAB << "~" << name << "() {" << std::endl;
+			impl << TAB << TAB << "const char* fname = std::getenv(\"CPPTEMPLATE_PROFILE\");" << std::endl;
+			impl << TAB << TAB << "std::ofstream out(fname ? fname : \"cpptemplate.profile\", std::ios::app);" << std::endl;
+			impl << TAB << TAB << "for(auto& c : counters)" << std::endl;
+			impl << TAB << TAB << TAB << "out << c.key << \" \" << c.index << \" \" << c.hits.load() << \"\\n\";" << std::endl;
+			impl << TAB << "}" << std::endl;
+			impl << "};" << std::endl;
+			impl << "}" << std::endl;
+			impl << std::endl;
+		}
+
 		impl << ast->get_classname() << "::" << ast->get_classname() << "()" << std::endl;
 		impl << "{" << std::endl;
 		{
 			auto code = ast->get_codeblock("init");
-			if(code) {
-				std::istringstream iss(code->get_code());
-				while(std::getline(iss, line)) impl << TAB << line << std::endl;
+			auto inherited = baseast ? SnapshotLevel(baseast, options) : nullptr;
+			if(inherited && HasSnapshot(ast, options)) {
+				// Our variables extend those the bases set up
+				auto type = "::" + inherited->get_namespace() + "::" + inherited->get_classname() + "::variables";
+				impl << TAB << "auto inherited_variables = this->current_variables.load();" << std::endl;
+				impl << TAB << "auto extended_variables = new variables();" << std::endl;
+				impl << TAB << "static_cast<" << type << "&>(*extended_variables) = static_cast<const " << type << "&>(*inherited_variables);" << std::endl;
+				impl << TAB << "this->current_variables.store(extended_variables);" << std::endl;
+				impl << TAB << "delete inherited_variables;" << std::endl;
 			}
+			if(code && HasSnapshot(ast, options)) {
+				// Nothing else sees the object yet, init writes straight into the first snapshot
+				impl << TAB << "auto& initial_variables = static_cast<variables&>(*this->current_variables.load());" << std::endl;
+				for(auto& v : ast->get_variables())
+					impl << TAB << "auto& " << v->get_name() << " = initial_variables." << v->get_name() << "; (void)" << v->get_name() << ";" << std::endl;
+			}
+			if(code)
+				BuildCodeBlock(impl, code, ast, options);
+			// init may have set variables of a base, so its sections are rendered again as well
+			if(ChainHasStatics(ast) && (code || !StaticSections(ast).empty()))
+				impl << TAB << "this->render_static();" << std::endl;
 		}
 		impl << "}" << std::endl;
 		impl << std::endl;
@@ -202,14 +1539,30 @@ namespace cpptemplate {
 		impl << "{" << std::endl;
 		{
 			auto code = ast->get_codeblock("deinit");
-			if(code) {
-				std::istringstream iss(code->get_code());
-				while(std::getline(iss, line)) impl << TAB << line << std::endl;
+			bool atomic = HasSnapshot(ast, options);
+			if(code && atomic) {
+				impl << TAB << "const auto& final_variables = static_cast<const variables&>(*this->current_variables.load());" << std::endl;
+				for(auto& v : ast->get_variables())
+					impl << TAB << "auto& " << v->get_name() << " = final_variables." << v->get_name() << "; (void)" << v->get_name() << ";" << std::endl;
 			}
+			if(code)
+				BuildCodeBlock(impl, code, ast, options);
+			if(OwnsSnapshot(ast, options))
+				impl << TAB << "delete this->current_variables.load();" << std::endl;
 		}
 		impl << "}" << std::endl;
 		impl << std::endl;
 
+		// Code is generated once per locale and output type
+		std::vector<GeneratorOptions> variants;
+		for(size_t i = 0; i < std::max<size_t>(options.catalogs.size(), 1); i++) {
+			for(auto& sink : SinkTypes(options)) {
+				variants.push_back(options);
+				if(!options.catalogs.empty()) variants.back().locale = options.catalogs[i];
+				if(sink != "std::string") variants.back().sink = sink;
+			}
+		}
+
 		if(ast->is_base_ast()) {
 			auto base = std::dynamic_pointer_cast<BaseTemplateAST>(ast);
 			// Main render method, implemented using append render
@@ -220,20 +1573,172 @@ namespace cpptemplate {
 			impl << TAB << "return res;" << std::endl;
 			impl << "}" << std::endl;
 			impl << std::endl;
+			// Parallel blocks are dispatched up front, each into its own buffer.
+			// Buffers are declared before the task group so they outlive any running task.
+			std::vector<std::string> parallel_blocks;
+			std::vector<BlockCallNodePtr> calls;
+			CollectBlockCalls(base->get_nodes(), calls);
+			for(auto& n : calls) {
+				auto block = ast->get_block(n->get_block());
+				if(block && block->is_parallel()) parallel_blocks.push_back(block->get_name());
+			}
+			auto body = [&](const GeneratorOptions& opts) {
+				for(auto& p : ast->get_parameters()) {
+					impl << TAB << "auto& " << p->get_name() << " = p." << p->get_name() << "; (void)" << p->get_name() << ";" << std::endl;
+				}
+				auto pinned = opts;
+				if(opts.atomic_variables) {
+					impl << BuildVariablesBlock(ast, options, TAB);
+					pinned.pinned = SnapshotLevel(ast, options) != nullptr;
+				}
+				if(!parallel_blocks.empty() && opts.sink.empty()) {
+					for(auto& name : parallel_blocks)
+						impl << TAB << "std::string block_buffer_" << name << ";" << std::endl;
+					impl << TAB << "render_tasks tasks(executor);" << std::endl;
+					for(auto& name : parallel_blocks)
+						impl << TAB << "auto block_task_" << name << " = tasks.run([&]() { " << (pinned.pinned ? "variables_snapshot task_snapshot(&pinned_snapshot); " : "")
+							<< BlockFunction(name, opts) << "(block_buffer_" << name << ", p); });" << std::endl;
+				}
+				auto nodes = opts.locale ? Localize(base->get_nodes(), ast, opts.locale) : base->get_nodes();
+				BuildActionRender(impl, nodes, ast, baseast, pinned, "", 1);
+			};
+
 			// Render at the end of an existing string
 			impl << "void " << ast->get_classname() << "::render(std::string& str, base_params& p) const" << std::endl;
 			impl << "{" << std::endl;
-			impl << TAB << "if(typeid(p) != get_param_type()) throw std::invalid_argument(\"invalid param struct\");" << std::endl;
-			for(auto& p : ast->get_parameters()) {
-				impl << TAB << "auto& " << p->get_name() << " = p." << p->get_name() << "; (void)" << p->get_name() << ";" << std::endl;
+			if(options.catalogs.empty()) {
+				impl << TAB << "if(typeid(p) != get_param_type()) throw std::invalid_argument(\"invalid param struct\");" << std::endl;
+				impl << TAB << "this->prerender(p);" << std::endl;
+				if(options.batch)
+					impl << TAB << "this->render_body(str, p);" << std::endl;
+				else
+					body(options);
+				impl << TAB << "this->postrender(p);" << std::endl;
+			} else {
+				impl << TAB << "this->render(str, p, locale::" << options.catalogs.front()->get_identifier() << ");" << std::endl;
+			}
+			impl << "}" << std::endl;
+			impl << std::endl;
+			if(options.batch && options.catalogs.empty()) {
+				// Shared by render and render_batch, the locale renders serve the same purpose with catalogs
+				impl << "void " << ast->get_classname() << "::render_body(std::string& str, base_params& p) const" << std::endl;
+				impl << "{" << std::endl;
+				body(options);
+				impl << "}" << std::endl;
+				impl << std::endl;
+			}
+
+			if(!options.catalogs.empty()) {
+				impl << "std::string " << ast->get_classname() << "::render(base_params& p, locale l) const" << std::endl;
+				impl << "{" << std::endl;
+				impl << TAB << "std::string res;" << std::endl;
+				impl << TAB << "this->render(res, p, l);" << std::endl;
+				impl << TAB << "return res;" << std::endl;
+				impl << "}" << std::endl;
+				impl << std::endl;
+				// Each locale has its own render with all translations folded into the text
+				impl << "void " << ast->get_classname() << "::render(std::string& str, base_params& p, locale l) const" << std::endl;
+				impl << "{" << std::endl;
+				impl << TAB << "if(typeid(p) != get_param_type()) throw std::invalid_argument(\"invalid param struct\");" << std::endl;
+				impl << TAB << "this->prerender(p);" << std::endl;
+				impl << TAB << "switch(l) {" << std::endl;
+				for(auto& c : options.catalogs)
+					impl << TAB << "case locale::" << c->get_identifier() << ": this->render_" << c->get_identifier() << "(str, p); break;" << std::endl;
+				impl << TAB << "}" << std::endl;
+				impl << TAB << "this->postrender(p);" << std::endl;
+				impl << "}" << std::endl;
+				impl << std::endl;
+				for(auto& opts : variants) {
+					impl << "void " << ast->get_classname() << "::render_" << opts.locale->get_identifier() << "(" << (opts.sink.empty() ? "std::string" : opts.sink) << "& str, base_params& p) const" << std::endl;
+					impl << "{" << std::endl;
+					body(opts);
+					impl << "}" << std::endl;
+					impl << std::endl;
+				}
 			}
-			impl << TAB << "this->prerender(p);" << std::endl;
 
-			impl << BuildActionRender(base->get_nodes(), ast, baseast, "", 1);
+			// Entry point rendering into a sink constructed by setup, finish runs before postrender and result is returned after it
+			auto sink_render = [&](const std::string& type, const std::string& name, const std::string& args, const std::string& argnames,
+					const std::string& sink, const std::string& setup, const std::string& finish, const std::string& result) {
+				impl << type << " " << ast->get_classname() << "::" << name << "(" << args << "base_params& p) const" << std::endl;
+				impl << "{" << std::endl;
+				if(options.catalogs.empty()) {
+					auto opts = options;
+					opts.sink = sink;
+					impl << TAB << "if(typeid(p) != get_param_type()) throw std::invalid_argument(\"invalid param struct\");" << std::endl;
+					impl << TAB << "this->prerender(p);" << std::endl;
+					impl << TAB << setup << std::endl;
+					body(opts);
+					if(!finish.empty()) impl << TAB << finish << std::endl;
+					impl << TAB << "this->postrender(p);" << std::endl;
+					if(!result.empty()) impl << TAB << "return " << result << ";" << std::endl;
+				} else {
+					impl << TAB << (result.empty() ? "" : "return ") << "this->" << name << "(" << argnames << "p, locale::" << options.catalogs.front()->get_identifier() << ");" << std::endl;
+				}
+				impl << "}" << std::endl;
+				impl << std::endl;
+				if(options.catalogs.empty()) return;
+				impl << type << " " << ast->get_classname() << "::" << name << "(" << args << "base_params& p, locale l) const" << std::endl;
+				impl << "{" << std::endl;
+				impl << TAB << "if(typeid(p) != get_param_type()) throw std::invalid_argument(\"invalid param struct\");" << std::endl;
+				impl << TAB << "this->prerender(p);" << std::endl;
+				impl << TAB << setup << std::endl;
+				impl << TAB << "switch(l) {" << std::endl;
+				for(auto& c : options.catalogs)
+					impl << TAB << "case locale::" << c->get_identifier() << ": this->render_" << c->get_identifier() << "(str, p); break;" << std::endl;
+				impl << TAB << "}" << std::endl;
+				if(!finish.empty()) impl << TAB << finish << std::endl;
+				impl << TAB << "this->postrender(p);" << std::endl;
+				if(!result.empty()) impl << TAB << "return " << result << ";" << std::endl;
+				impl << "}" << std::endl;
+				impl << std::endl;
+			};
+			if(options.deflate) {
+				impl << "std::string " << ast->get_classname() << "::render_deflate(base_params& p) const" << std::endl;
+				impl << "{" << std::endl;
+				impl << TAB << "std::string res;" << std::endl;
+				impl << TAB << "this->render_deflate(res, p);" << std::endl;
+				impl << TAB << "return res;" << std::endl;
+				impl << "}" << std::endl;
+				impl << std::endl;
+				sink_render("void", "render_deflate", "std::string& out, ", "out, ", "deflate_sink", "deflate_sink str(out);", "str.finish();", "");
+			}
+			if(options.hash) {
+				sink_render("uint32_t", "render_hashed", "std::string& out, ", "out, ", "hash_sink", "hash_sink str(&out);", "", "str.value()");
+				sink_render("uint32_t", "render_hash", "", "", "hash_sink", "hash_sink str(nullptr);", "", "str.value()");
+			}
+		}
 
-			impl << TAB << "this->postrender(p);" << std::endl;
+		if(options.batch) {
+			auto cls = ast->get_classname();
+			// Hooks of the chain are known here, a class deriving from the generated one may still add its own
+			bool hooks = false;
+			for(ASTPtr l = ast; l; l = l->is_base_ast() ? nullptr : std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast())
+				if(l->get_codeblock("prerender") || l->get_codeblock("postrender")) hooks = true;
+			auto batch = [&](const std::string& select) {
+				impl << TAB << "if(get_param_type() != typeid(params)) throw std::invalid_argument(\"invalid param struct\");" << std::endl;
+				impl << TAB << "bool hooks = " << (hooks ? "true" : "typeid(*this) != typeid(" + cls + ")") << ";" << std::endl;
+				impl << select;
+				impl << TAB << "return this->run_batch(count, out, parallel, hooks, [p](size_t i) -> base_params& { return p[i]; }, fn);" << std::endl;
+			};
+			impl << "std::vector<size_t> " << cls << "::render_batch(params* p, size_t count, std::string& out, bool parallel) const" << std::endl;
+			impl << "{" << std::endl;
+			if(options.catalogs.empty())
+				batch(TAB + "batch_render fn = &" + cls + "::render_body;\n");
+			else
+				impl << TAB << "return this->render_batch(p, count, out, locale::" << options.catalogs.front()->get_identifier() << ", parallel);" << std::endl;
 			impl << "}" << std::endl;
 			impl << std::endl;
+			if(!options.catalogs.empty()) {
+				impl << "std::vector<size_t> " << cls << "::render_batch(params* p, size_t count, std::string& out, locale l, bool parallel) const" << std::endl;
+				impl << "{" << std::endl;
+				std::string select = TAB + "batch_render fn = nullptr;\n" + TAB + "switch(l) {\n";
+				for(auto& c : options.catalogs)
+					select += TAB + "case locale::" + c->get_identifier() + ": fn = &" + cls + "::render_" + c->get_identifier() + "; break;\n";
+				batch(select + TAB + "}\n");
+				impl << "}" << std::endl;
+				impl << std::endl;
+			}
 		}
 
 		impl << "const std::type_info& " << ast->get_classname() << "::get_param_type() const" << std::endl;
@@ -246,11 +1751,11 @@ namespace cpptemplate {
 		impl << "{" << std::endl;
 		{
 			impl << BuildParamsBlock(ast);
+			if(options.atomic_variables)
+				impl << BuildVariablesBlock(ast, options, TAB);
 			auto code = ast->get_codeblock("prerender");
-			if(code) {
-				std::istringstream iss(code->get_code());
-				while(std::getline(iss, line)) impl << TAB << line << std::endl;
-			}
+			if(code)
+				BuildCodeBlock(impl, code, ast, options);
 		}
 		impl << "}" << std::endl;
 		impl << std::endl;
@@ -259,28 +1764,220 @@ namespace cpptemplate {
 		impl << "{" << std::endl;
 		{
 			impl << BuildParamsBlock(ast);
+			if(options.atomic_variables)
+				impl << BuildVariablesBlock(ast, options, TAB);
 			auto code = ast->get_codeblock("postrender");
-			if(code) {
-				std::istringstream iss(code->get_code());
-				while(std::getline(iss, line)) impl << TAB << line << std::endl;
-			}
+			if(code)
+				BuildCodeBlock(impl, code, ast, options);
 		}
 		impl << "}" << std::endl;
 		impl << std::endl;
 
-		for (auto& e : ast->get_blocks()) {
-			impl << "void " << ast->get_classname() << "::renderBlock_" << e->get_name() << "(std::string& str __attribute__((unused)), base_params& p __attribute__((unused))) const" << std::endl;
-			impl << "{" << std::endl;
-			
-			impl << BuildParamsBlock(ast);
+		if(options.json)
+			impl << BuildJsonReader(ast);
 
-			impl << BuildActionRender(e->get_nodes(), ast, baseast, e->get_name(), 1);
+		if(OwnsSnapshot(ast, options)) {
+			auto cls = ast->get_classname();
+			impl << "thread_local const " << cls << "::variables_snapshot* " << cls << "::variables_snapshot::innermost = nullptr;" << std::endl;
+			impl << std::endl;
+			impl << cls << "::variables_snapshot::variables_snapshot(const " << cls << R"(& owner)
+	: object(&owner), readers(nullptr), value(nullptr), outer(innermost)
+{
+	innermost = this;
+	for(auto s = outer; s; s = s->outer) {
+		if(s->object == object) {
+			value = s->value;
+			return;
+		}
+	}
+	// Count ourselves on the side of the current epoch, a setter flipping it meanwhile may not wait for us
+	for(;;) {
+		auto epoch = owner.variables_epoch.load();
+		readers = &owner.variables_readers[epoch & 1];
+		readers->fetch_add(1);
+		if(owner.variables_epoch.load() == epoch) break;
+		readers->fetch_sub(1);
+	}
+	value = owner.current_variables.load();
+}
+
+)" << cls << "::variables_snapshot::variables_snapshot(const variables_snapshot* shared)" << R"(
+	: object(shared->object), readers(nullptr), value(shared->value), outer(innermost)
+{
+	innermost = this;
+}
+
+)" << cls << "::variables_snapshot::~variables_snapshot()" << R"(
+{
+	innermost = outer;
+	if(readers) readers->fetch_sub(1, std::memory_order_release);
+}
+
+void )" << cls << R"(::publish_variables(variables* next)
+{
+	// Readers counted before the flip may still use the old snapshot, it is freed once they are done.
+	// Readers counted after it only see the new one, so a steady stream of renders can not hold us up.
+	auto old = current_variables.exchange(next);
+	auto epoch = variables_epoch.fetch_add(1);
+	while(variables_readers[epoch & 1].load() != 0)
+		std::this_thread::yield();
+	delete old;
+}
+)" << std::endl;
+		}
 
+		auto statics = StaticSections(ast);
+		if(!statics.empty()) {
+			bool atomic = HasSnapshot(ast, options);
+			bool first = !(baseast && ChainHasStatics(baseast));
+			if(atomic && first) {
+				impl << "void " << ast->get_classname() << "::render_static()" << std::endl;
+				impl << "{" << std::endl;
+				impl << TAB << "update_variables([](variables&) {});" << std::endl;
+				impl << "}" << std::endl;
+				impl << std::endl;
+			}
+			// Sections of the bases first, ours may show their variables too.
+			// With a snapshot they are rendered into the next one before it is published, from the variables it holds.
+			if(atomic)
+				impl << "void " << ast->get_classname() << "::render_static_into(" << SnapshotType(ast, options) << "& next_variables)" << std::endl;
+			else
+				impl << "void " << ast->get_classname() << "::render_static()" << std::endl;
+			impl << "{" << std::endl;
+			if(!first)
+				impl << TAB << baseast->get_classname() << (atomic ? "::render_static_into(next_variables);" : "::render_static();") << std::endl;
+			if(atomic) {
+				impl << TAB << "auto& next_snapshot = static_cast<variables&>(next_variables);" << std::endl;
+				impl << BindVariables(ast, options, "next_snapshot", TAB);
+			}
+			for(size_t i = 0; i < std::max<size_t>(options.catalogs.size(), 1); i++) {
+				// Only rendered into a string, whatever sink a render uses appends the result
+				auto opts = options;
+				opts.sink.clear();
+				if(!options.catalogs.empty()) opts.locale = options.catalogs[i];
+				for(auto& s : statics) {
+					auto nodes = opts.locale ? Localize(s->get_nodes(), ast, opts.locale) : s->get_nodes();
+					impl << TAB << "{" << std::endl;
+					impl << TAB << TAB << "std::string& str = " << (atomic ? "next_snapshot." : "this->") << StaticSection(ast, s->get_index(), opts) << ";" << std::endl;
+					impl << TAB << TAB << "str.clear();" << std::endl;
+					BuildActionRender(impl, nodes, ast, baseast, opts, "", 2);
+					impl << TAB << "}" << std::endl;
+				}
+			}
 			impl << "}" << std::endl;
 			impl << std::endl;
 		}
 
+		for (auto& e : ast->get_blocks()) {
+			for(auto& opts : variants) {
+				impl << "void " << ast->get_classname() << "::" << BlockFunction(e->get_name(), opts) << "(" << (opts.sink.empty() ? "std::string" : opts.sink) << "& str __attribute__((unused)), base_params& p __attribute__((unused))) const" << std::endl;
+				impl << "{" << std::endl;
+
+				impl << BuildParamsBlock(ast);
+				auto pinned = opts;
+				if(opts.atomic_variables) {
+					impl << BuildVariablesBlock(ast, options, TAB);
+					pinned.pinned = SnapshotLevel(ast, options) != nullptr;
+				}
+
+				auto nodes = opts.locale ? Localize(e->get_nodes(), ast, opts.locale) : e->get_nodes();
+				BuildActionRender(impl, nodes, ast, baseast, pinned, e->get_name(), 1);
+
+				impl << "}" << std::endl;
+				impl << std::endl;
+			}
+		}
+
+		if(OwnsExecutor(ast, options)) {
+			impl << "void " << ast->get_classname() << R"(::render_tasks::task::run()
+{
+	if(claimed.exchange(true))
+		return;
+	try {
+		fn();
+		done.set_value();
+	} catch(...) {
+		done.set_exception(std::current_exception());
+	}
+}
+
+)" << ast->get_classname() << R"(::render_tasks::~render_tasks()
+{
+	// Drops the tasks nobody started, never leaves one running that still references our stack
+	for(size_t i = 0; i < tasks.size(); i++)
+		if(tasks[i]->claimed.exchange(true) && results[i].valid()) results[i].wait();
+}
+
+size_t )" << ast->get_classname() << R"(::render_tasks::run(std::function<void()> fn)
+{
+	auto t = std::make_shared<task>(std::move(fn));
+	tasks.push_back(t);
+	results.push_back(t->done.get_future());
+	if(executor) executor([t]() { t->run(); });
+	else t->run();
+	return tasks.size() - 1;
+}
+
+void )" << ast->get_classname() << R"(::render_tasks::get(size_t idx)
+{
+	// Runs it here unless a worker already started it
+	tasks[idx]->run();
+	results[idx].get();
+}
+)" << std::endl;
+		}
+
 		if(ast->is_base_ast()) {
+			if(options.batch) {
+				impl << "std::vector<size_t> " << ast->get_classname() << R"(::run_batch(size_t count, std::string& out, bool parallel, bool hooks,
+	const std::function<base_params&(size_t)>& at, batch_render fn) const
+{
+	std::vector<size_t> offsets(count + 1);
+	// Renders [begin, end) at the end of str, offsets are relative to the start of str
+	auto run = [&](size_t begin, size_t end, std::string& str) {
+		auto start = str.size();
+		for(size_t i = begin; i < end; i++) {
+			auto& p = at(i);
+			offsets[i] = str.size();
+			if(hooks) this->prerender(p);
+			(this->*fn)(str, p);
+			if(hooks) this->postrender(p);
+			// Sized after the first output instead of doubling all the way up
+			if(i == begin) str.reserve(start + (str.size() - start) * (end - begin));
+		}
+	};
+	// A few chunks per thread even out renders of different length
+	size_t chunks = parallel && executor ? std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()) * 4) : 1;
+	if(chunks <= 1) {
+		run(0, count, out);
+		offsets[count] = out.size();
+		return offsets;
+	}
+	// The first chunk renders straight into out, waiting on the others runs them here if no worker started them yet
+	std::vector<std::string> buffers(chunks);
+	{
+		render_tasks tasks(executor);
+		for(size_t c = 1; c < chunks; c++)
+			tasks.run([&, c]() { run(count * c / chunks, count * (c + 1) / chunks, buffers[c]); });
+		run(0, count / chunks, out);
+		for(size_t c = 1; c < chunks; c++)
+			tasks.get(c - 1);
+	}
+	size_t total = out.size();
+	for(auto& b : buffers)
+		total += b.size();
+	out.reserve(total);
+	for(size_t c = 1; c < chunks; c++) {
+		auto shift = out.size();
+		for(size_t i = count * c / chunks; i < count * (c + 1) / chunks; i++)
+			offsets[i] += shift;
+		out.append(buffers[c]);
+	}
+	offsets[count] = out.size();
+	return offsets;
+}
+)" << std::endl;
+			}
 			impl << "std::string " << ast->get_classname() << R"(::strlocaltime(time_t time, const char* fmt) {
 	struct tm t;
 	std::string s;
@@ -293,17 +1990,257 @@ namespace cpptemplate {
 	s.resize(std::strftime((char*)s.data(), s.size(), fmt, &t));
 	return s;
 })" << std::endl;
+			if(options.deflate) {
+				impl << ast->get_classname() << R"(::deflate_sink::deflate_sink(std::string& o)
+	: out(o)
+{
+	// gzip header without name and timestamp
+	static const char header[] = { '\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, '\xff' };
+	out.append(header, sizeof(header));
+}
+
+)" << ast->get_classname() << R"(::deflate_sink::~deflate_sink()
+{
+	if(stream) {
+		deflateEnd(static_cast<z_stream*>(stream));
+		delete static_cast<z_stream*>(stream);
+	}
+}
+
+void )" << ast->get_classname() << R"(::deflate_sink::compress(bool align)
+{
+	if(!stream) {
+		auto zs = new z_stream();
+		if(deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			delete zs;
+			throw std::runtime_error("failed to initialize zlib");
+		}
+		stream = zs;
+	}
+	auto zs = static_cast<z_stream*>(stream);
+	crc = crc32(crc, reinterpret_cast<const Bytef*>(pending.data()), pending.size());
+	size += pending.size();
+	zs->next_in = reinterpret_cast<Bytef*>(&pending[0]);
+	zs->avail_in = pending.size();
+	// A full flush aligns to a byte boundary and drops the history, precompressed text may follow
+	do {
+		auto offset = out.size();
+		out.resize(offset + deflateBound(zs, zs->avail_in) + 16);
+		zs->next_out = reinterpret_cast<Bytef*>(&out[offset]);
+		zs->avail_out = out.size() - offset;
+		auto ret = deflate(zs, align ? Z_FULL_FLUSH : Z_NO_FLUSH);
+		out.resize(out.size() - zs->avail_out);
+		if(ret != Z_OK && ret != Z_BUF_ERROR) throw std::runtime_error("failed to compress output");
+	} while(zs->avail_in != 0 || zs->avail_out == 0);
+	pending.clear();
+	dirty = !align;
+}
+
+void )" << ast->get_classname() << R"(::deflate_sink::literal(const deflate_literal& lit)
+{
+	if(dirty || !pending.empty()) compress(true);
+	out.append(lit.data, lit.size);
+	crc = crc32_combine(crc, lit.crc, lit.length);
+	size += lit.length;
+}
+
+void )" << ast->get_classname() << R"(::deflate_sink::finish()
+{
+	if(dirty || !pending.empty()) compress(true);
+	// Empty final block followed by the gzip trailer
+	out += '\x03';
+	out += '\x00';
+	for(int i = 0; i < 4; i++) out += static_cast<char>(crc >> (i * 8));
+	for(int i = 0; i < 4; i++) out += static_cast<char>(size >> (i * 8));
+}
+)" << std::endl;
+			}
+			if(options.hash) {
+				impl << "void " << ast->get_classname() << R"(::hash_sink::update(const char* data, size_t length)
+{
+#ifdef __SSE4_2__
+	uint64_t c = crc;
+	for(; length >= 8; data += 8, length -= 8) {
+		uint64_t v;
+		memcpy(&v, data, sizeof(v));
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = static_cast<uint32_t>(c);
+	for(; length; data++, length--)
+		crc = _mm_crc32_u8(crc, static_cast<unsigned char>(*data));
+#else
+	static const auto table = []() {
+		std::array<uint32_t, 256> t {};
+		for(uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for(int j = 0; j < 8; j++) c = c & 1 ? (c >> 1) ^ )" << HASH_POLYNOMIAL << R"(u : c >> 1;
+			t[i] = c;
+		}
+		return t;
+	}();
+	for(; length; data++, length--)
+		crc = table[(crc ^ static_cast<unsigned char>(*data)) & 0xff] ^ (crc >> 8);
+#endif
+}
+
+uint32_t )" << ast->get_classname() << R"(::hash_sink::multiply(uint32_t a, uint32_t b)
+{
+	// Carry-less multiplication modulo the polynomial in reflected bit order
+	uint32_t p = 0;
+	for(uint32_t m = 1u << 31; m; m >>= 1) {
+		if(a & m) p ^= b;
+		b = b & 1 ? (b >> 1) ^ )" << HASH_POLYNOMIAL << R"(u : b >> 1;
+	}
+	return p;
+}
+
+void )" << ast->get_classname() << R"(::hash_sink::literal(const hash_literal& lit)
+{
+	if(out) out->append(lit.data, lit.length);
+	crc = multiply(lit.shift, crc) ^ lit.crc;
+}
+)" << std::endl;
+			}
+			if(!options.utf8.empty()) {
+				impl << "size_t " << ast->get_classname() << R"(::utf8_sequence(const unsigned char* s, size_t n, size_t& invalid)
+{
+	// Length of the sequence at s, or 0 with the length of its maximal invalid subpart
+	size_t len;
+	unsigned char lo = 0x80, hi = 0xbf;
+	if(s[0] < 0x80) return 1;
+	else if(s[0] >= 0xc2 && s[0] <= 0xdf) len = 2;
+	else if(s[0] >= 0xe0 && s[0] <= 0xef) { len = 3; if(s[0] == 0xe0) lo = 0xa0; else if(s[0] == 0xed) hi = 0x9f; }
+	else if(s[0] >= 0xf0 && s[0] <= 0xf4) { len = 4; if(s[0] == 0xf0) lo = 0x90; else if(s[0] == 0xf4) hi = 0x8f; }
+	else { invalid = 1; return 0; }
+	for(size_t i = 1; i < len; i++) {
+		if(i >= n || s[i] < lo || s[i] > hi) { invalid = i; return 0; }
+		lo = 0x80;
+		hi = 0xbf;
+	}
+	return len;
+}
+
+size_t )" << ast->get_classname() << R"(::utf8_valid_prefix(const char* data, size_t n)
+{
+	auto s = reinterpret_cast<const unsigned char*>(data);
+	size_t i = 0, invalid = 0;
+	while(i < n) {
+#ifdef __SSE2__
+		// ASCII is skipped 16 bytes at a time, only the other bytes are decoded
+		if(i + 16 <= n) {
+			if(!_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i)))) {
+				i += 16;
+				continue;
+			}
+			while(s[i] < 0x80) i++;
+		}
+#endif
+		auto len = utf8_sequence(s + i, n - i, invalid);
+		if(!len) return i;
+		i += len;
+	}
+	return n;
+}
+
+std::string_view )" << ast->get_classname() << R"(::valid_utf8(std::string_view v, std::string&& replaced)
+{
+	auto valid = utf8_valid_prefix(v.data(), v.size());
+	if(valid == v.size()) return v;
+)";
+				if(options.utf8 == "check") {
+					impl << R"(	(void)replaced;
+	throw std::runtime_error("output is not valid UTF-8 at byte " + std::to_string(valid));
+}
+)";
+				} else {
+					impl << R"(	// Every maximal invalid subpart becomes one U+FFFD, as a browser decodes it
+	replaced.clear();
+	size_t i = 0, invalid = 0;
+	while(i < v.size()) {
+		replaced.append(v.data() + i, valid);
+		i += valid;
+		if(i == v.size()) break;
+		utf8_sequence(reinterpret_cast<const unsigned char*>(v.data()) + i, v.size() - i, invalid);
+		replaced.append("\xef\xbf\xbd");
+		i += invalid;
+		valid = utf8_valid_prefix(v.data() + i, v.size() - i);
+	}
+	return replaced;
+}
+)";
+				}
+				impl << R"(
+void )" << ast->get_classname() << R"(::valid_utf8_tail(std::string& str, size_t start)
+{
+	std::string replaced;
+	auto v = valid_utf8(std::string_view(str).substr(start), std::move(replaced));
+	if(v.data() == str.data() + start) return;
+	str.resize(start);
+	str.append(v);
+}
+)" << std::endl;
+			}
+		}
+
+		if(options.deflate) {
+			std::vector<std::string> literals(options.deflate_literals->size());
+			for(auto& e : *options.deflate_literals)
+				literals[e.second] = e.first;
+			impl << "const " << ast->get_classname() << "::deflate_literal " << ast->get_classname() << "::deflate_literals[] = {" << std::endl;
+			for(auto& lit : literals) {
+				auto compressed = CompressLiteral(lit);
+				auto crc = crc32(0, reinterpret_cast<const Bytef*>(lit.data()), lit.size());
+				impl << TAB << "{ \"" << SanitizeBinary(compressed) << "\", " << compressed.size() << ", " << crc << "u, " << lit.size() << " }," << std::endl;
+			}
+			impl << TAB << "{ nullptr, 0, 0, 0 }" << std::endl;
+			impl << "};" << std::endl;
+			impl << std::endl;
+		}
+		if(options.hash) {
+			std::vector<std::string> literals(options.hash_literals->size());
+			for(auto& e : *options.hash_literals)
+				literals[e.second] = e.first;
+			impl << "const " << ast->get_classname() << "::hash_literal " << ast->get_classname() << "::hash_literals[] = {" << std::endl;
+			for(auto& lit : literals) {
+				uint32_t crc, shift;
+				HashLiteral(lit, crc, shift);
+				impl << TAB << "{ " << BuildLiteralData(lit, ast, options) << ", " << lit.size() << ", " << crc << "u, " << shift << "u }," << std::endl;
+			}
+			impl << TAB << "{ nullptr, 0, 0, 0 }" << std::endl;
+			impl << "};" << std::endl;
+			impl << std::endl;
+		}
+
+		if(options.blob && !options.blob->empty()) {
+			auto name = SanitizePlainText(options.blob_name);
+			auto symbol = BlobSymbol(ast);
+			impl << "#if defined(__has_embed)" << std::endl;
+			impl << "const unsigned char " << ast->get_classname() << "_blob[] = {" << std::endl;
+			impl << "#embed \"" << name << "\"" << std::endl;
+			impl << "};" << std::endl;
+			impl << "#elif defined(__ELF__)" << std::endl;
+			// Relative to the working directory of the assembler rather than this file, an absolute path would tie the
+			// generated code to the machine it was generated on
+			impl << "// The assembler finds " << name << " in its include path, gcc passes -I<directory of this file> on to it" << std::endl;
+			impl << "__asm__(\".pushsection .rodata\\n\"" << std::endl;
+			impl << "\t\".globl " << symbol << "\\n\"" << std::endl;
+			impl << "\t\".hidden " << symbol << "\\n\"" << std::endl;
+			impl << "\t\"" << symbol << ":\\n\"" << std::endl;
+			impl << "\t\".incbin \\\"" << SanitizePlainText(name) << "\\\"\\n\"" << std::endl;
+			impl << "\t\".popsection\\n\");" << std::endl;
+			impl << "#else" << std::endl;
+			impl << "#error \"static text in a blob file needs #embed or an ELF assembler\"" << std::endl;
+			impl << "#endif" << std::endl;
+			impl << std::endl;
 		}
 
 		for(auto& ns : split(ast->get_namespace(), "::"))
 		{
 			impl << "} // namespace " << ns << std::endl;
 		}
-
-		return impl.str();
 	}
 
-	std::string Generator::GenerateHeader(ASTPtr ast) {
+	std::string Generator::GenerateHeader(ASTPtr ast, const GeneratorOptions& options) {
 		ASTPtr baseast;
 		if(!ast->is_base_ast())
 			baseast = std::dynamic_pointer_cast<ExtendingTemplateAST>(ast)->get_base_template_ast();
@@ -316,11 +2253,47 @@ namespace cpptemplate {
 			parts.back() = baseast->get_classname() + ".h";
 			header << "#include \"" << join("/", parts) << "\"" << std::endl;
 		}
-		for (auto& incl : ast->get_header_includes()) {
-			header << "#include " << incl << std::endl;
+		// Variables are members of the class, their types have to be complete
+		if(!options.lean_header || !ast->get_variables().empty()) {
+			for (auto& incl : ast->get_header_includes()) {
+				header << "#include " << incl << std::endl;
+			}
 		}
-		if(ast->get_header_includes().count("<string>") == 0)
+		if(options.lean_header || ast->get_header_includes().count("<string>") == 0)
 			header << "#include <string>" << std::endl;
+		// get_param_type returns it, nothing else pulls it in reliably
+		if(ast->is_base_ast())
+			header << "#include <typeinfo>" << std::endl;
+		bool executor = OwnsExecutor(ast, options);
+		bool deferred = OwnsDeferred(ast);
+		if(executor) {
+			header << "#include <atomic>" << std::endl;
+			header << "#include <functional>" << std::endl;
+			header << "#include <future>" << std::endl;
+			header << "#include <memory>" << std::endl;
+			header << "#include <vector>" << std::endl;
+		}
+		if(deferred) {
+			if(!executor)
+				header << "#include <future>" << std::endl;
+			header << "#include <utility>" << std::endl;
+		}
+		if(options.json || options.prerender)
+			header << "#include <string_view>" << std::endl;
+		if(HasSnapshot(ast, options)) {
+			header << "#include <atomic>" << std::endl;
+			header << "#include <cstdint>" << std::endl;
+			header << "#include <memory>" << std::endl;
+			header << "#include <mutex>" << std::endl;
+		}
+		if(options.deflate && ast->is_base_ast())
+			header << "#include <cstdint>" << std::endl;
+		if(options.hash && ast->is_base_ast()) {
+			header << "#include <cstdint>" << std::endl;
+			header << "#include <string_view>" << std::endl;
+		}
+		if(!options.utf8.empty() && ast->is_base_ast())
+			header << "#include <string_view>" << std::endl;
 		
 		for(auto& ns : split(ast->get_namespace(), "::"))
 		{
@@ -331,18 +2304,41 @@ namespace cpptemplate {
 		else header << " : public ::" << baseast->get_namespace() << "::" << baseast->get_classname() << std::endl;
 		header << "{" << std::endl;
 		header << TAB << "public:" << std::endl;
+		if(deferred) {
+			// Types of params evaluated at their first use while rendering, at most once even if blocks render concurrently
+			header << TAB << TAB << R"(template<typename T>
+		class lazy
+		{
+			std::shared_future<T> value {};
+		public:
+			lazy() {}
+			template<typename F, typename = decltype(std::declval<F&>()())>
+			lazy(F fn) : value(std::async(std::launch::deferred, std::move(fn)).share()) {}
+			const T& get() const { return value.get(); }
+			operator const T&() const { return get(); }
+		};
+		// Computed concurrently from when it is set, rendering only waits for it where it is used
+		template<typename T>
+		class async
+		{
+			std::shared_future<T> value {};
+		public:
+			async() {}
+			async(std::future<T> f) : value(f.share()) {}
+			async(std::shared_future<T> f) : value(std::move(f)) {}
+			template<typename F, typename = decltype(std::declval<F&>()())>
+			async(F fn) : value(std::async(std::launch::async, std::move(fn)).share()) {}
+			const T& get() const { return value.get(); }
+			operator const T&() const { return get(); }
+		};
+)" << std::endl;
+		}
 		if(baseast && ast->get_parameters().empty()) {
 			header << TAB << TAB << "typedef ::" << baseast->get_namespace() << "::" << baseast->get_classname() << "::params params;" << std::endl;
-		} else{
-			header << TAB << TAB << "struct params" << std::endl;
-			if(baseast) header << TAB << TAB << TAB << ": " << baseast->get_classname() << "::params" << std::endl;
-			header << TAB << TAB << "{" << std::endl;
-			if(ast->is_base_ast()) // We need a virtual method for typeid to return the correct type
-				header << TAB << TAB << TAB << "virtual ~params() {}" << std::endl;
-			for (auto& param : ast->get_parameters()) {
-				header << TAB << TAB << TAB << param->get_type() << " " << param->get_name() << " {};" << std::endl;
-			}
-			header << TAB << TAB << "};" << std::endl;
+		} else if(options.lean_header) {
+			header << TAB << TAB << "struct params; // " << ast->get_classname() << "_params.h" << std::endl;
+		} else {
+			header << BuildParamsStruct(ast, "params", TAB + TAB);
 		}
 		if(ast->is_base_ast())
 			header << TAB << TAB << "typedef struct params base_params;" << std::endl;
@@ -352,24 +2348,314 @@ namespace cpptemplate {
 		if(ast->is_base_ast()) {
 			header << TAB << TAB << "std::string render(base_params& p) const;" << std::endl; // Main render method
 			header << TAB << TAB << "void render(std::string& str, base_params& p) const;" << std::endl; // Render append
+			if(!options.catalogs.empty()) {
+				// Locales the template was compiled for, render without a locale uses the first one
+				header << TAB << TAB << "enum class locale {";
+				for(size_t i = 0; i < options.catalogs.size(); i++)
+					header << (i == 0 ? " " : ", ") << options.catalogs[i]->get_identifier();
+				header << " };" << std::endl;
+				header << TAB << TAB << "static const size_t locale_count = " << options.catalogs.size() << ";" << std::endl;
+				header << TAB << TAB << "std::string render(base_params& p, locale l) const;" << std::endl;
+				header << TAB << TAB << "void render(std::string& str, base_params& p, locale l) const;" << std::endl;
+			}
+			if(options.deflate) {
+				// Renders a gzip stream, static text is compressed at compile time and spliced in
+				header << TAB << TAB << "std::string render_deflate(base_params& p) const;" << std::endl;
+				header << TAB << TAB << "void render_deflate(std::string& out, base_params& p) const;" << std::endl;
+				if(!options.catalogs.empty())
+					header << TAB << TAB << "void render_deflate(std::string& out, base_params& p, locale l) const;" << std::endl;
+			}
+			if(options.hash) {
+				// CRC32C of the output computed while rendering, e.g. for an ETag.
+				// render_hash keeps no output, enough to answer a conditional request.
+				header << TAB << TAB << "uint32_t render_hashed(std::string& out, base_params& p) const;" << std::endl;
+				header << TAB << TAB << "uint32_t render_hash(base_params& p) const;" << std::endl;
+				if(!options.catalogs.empty()) {
+					header << TAB << TAB << "uint32_t render_hashed(std::string& out, base_params& p, locale l) const;" << std::endl;
+					header << TAB << TAB << "uint32_t render_hash(base_params& p, locale l) const;" << std::endl;
+				}
+			}
+			header << std::endl;
+		}
+		if(executor) {
+			// Parallel blocks and loops are handed to this executor, if none is set they run inline
+			header << TAB << TAB << "typedef std::function<void(std::function<void()>)> executor_type;" << std::endl;
+			header << TAB << TAB << "void set_executor(executor_type e) { this->executor = std::move(e); }" << std::endl;
+			header << std::endl;
+		}
+		if(options.batch) {
+			// Appends the output of p[0] to p[count - 1] to out back to back and returns the count + 1 offsets delimiting them.
+			// The param type is checked once and hooks only run if some template has them.
+			// Takes mutable params rather than a span of const ones, prerender and postrender get a base_params& to adjust.
+			// Parallel renders chunks on the executor and splices them in order. Parallel blocks and loops of a chunk share the
+			// executor, a render waiting on queued work runs it itself, so a pool of any size makes progress.
+			header << TAB << TAB << "std::vector<size_t> render_batch(params* p, size_t count, std::string& out, bool parallel = false) const;" << std::endl;
+			if(!options.catalogs.empty())
+				header << TAB << TAB << "std::vector<size_t> render_batch(params* p, size_t count, std::string& out, locale l, bool parallel = false) const;" << std::endl;
+			header << std::endl;
+		}
+		if(options.prerender) {
+			// Output known at compile time, returned without rendering
+			std::string text;
+			std::ostringstream accessors;
+			if(Prerender(ast, text))
+				accessors << TAB << TAB << "static constexpr std::string_view static_render() { return std::string_view(\"" << SanitizePlainText(text) << "\", " << text.size() << "); }" << std::endl;
+			for(auto& b : ast->get_blocks())
+				if(PrerenderBlock(ast, b->get_name(), text))
+					accessors << TAB << TAB << "static constexpr std::string_view static_block_" << b->get_name() << "() { return std::string_view(\"" << SanitizePlainText(text) << "\", " << text.size() << "); }" << std::endl;
+			if(!accessors.str().empty())
+				header << accessors.str() << std::endl;
+		}
+		if(options.json) {
+			// Fills p from a JSON object, unknown keys are skipped and null resets a field
+			header << TAB << TAB << "static void from_json(std::string_view json, params& p);" << std::endl;
+			header << std::endl;
+		}
+		bool atomic = HasSnapshot(ast, options);
+		bool owner = OwnsSnapshot(ast, options);
+		if(atomic) {
+			// Renders pin the current snapshot without a lock, setters publish a modified copy.
+			// A setter waits for renders still using the snapshot it replaced, so never call one while rendering.
+			// The chain shares a single snapshot, the variables of a template extend those of its bases.
+			auto inherited = baseast ? SnapshotLevel(baseast, options) : nullptr;
+			header << TAB << TAB << "struct variables";
+			if(inherited)
+				header << " : ::" << inherited->get_namespace() << "::" << inherited->get_classname() << "::variables";
 			header << std::endl;
+			header << TAB << TAB << "{" << std::endl;
+			if(owner)
+				header << TAB << TAB << TAB << "virtual ~variables() {}" << std::endl;
+			for (auto& var : ast->get_variables())
+				header << TAB << TAB << TAB << var->get_type() << " " << var->get_name() << " {}; // " << var->get_function_name() << std::endl;
+			for(auto& name : StaticMembers(ast, options))
+				header << TAB << TAB << TAB << "std::string " << name << " {};" << std::endl;
+			header << TAB << TAB << TAB << (owner ? "virtual variables* clone() const" : "variables* clone() const override") << " { return new variables(*this); }" << std::endl;
+			header << TAB << TAB << "};" << std::endl;
+			if(owner) {
+				// Pins taken while the object is pinned on the thread already share that snapshot, so a render sees one
+				header << TAB << TAB << "class variables_snapshot" << std::endl;
+				header << TAB << TAB << "{" << std::endl;
+				header << TAB << TAB << TAB << "const " << ast->get_classname() << "* object;" << std::endl;
+				header << TAB << TAB << TAB << "std::atomic<size_t>* readers;" << std::endl;
+				header << TAB << TAB << TAB << "const variables* value;" << std::endl;
+				header << TAB << TAB << TAB << "const variables_snapshot* outer;" << std::endl;
+				header << TAB << TAB << TAB << "static thread_local const variables_snapshot* innermost;" << std::endl;
+				header << TAB << TAB << "public:" << std::endl;
+				header << TAB << TAB << TAB << "explicit variables_snapshot(const " << ast->get_classname() << "& owner);" << std::endl;
+				header << TAB << TAB << TAB << "// Shares a snapshot pinned on another thread for a task it outlives" << std::endl;
+				header << TAB << TAB << TAB << "explicit variables_snapshot(const variables_snapshot* shared);" << std::endl;
+				header << TAB << TAB << TAB << "variables_snapshot(const variables_snapshot&) = delete;" << std::endl;
+				header << TAB << TAB << TAB << "variables_snapshot& operator=(const variables_snapshot&) = delete;" << std::endl;
+				header << TAB << TAB << TAB << "~variables_snapshot();" << std::endl;
+				header << TAB << TAB << TAB << "const variables* operator->() const { return value; }" << std::endl;
+				header << TAB << TAB << TAB << "const variables& operator*() const { return *value; }" << std::endl;
+				header << TAB << TAB << "};" << std::endl;
+				header << TAB << TAB << "variables_snapshot get_variables() const { return variables_snapshot(*this); }" << std::endl;
+			}
+			// Several variables changed at once become visible together, with the sections rendered from them
+			header << TAB << TAB << "template<typename F>" << std::endl;
+			header << TAB << TAB << "void update_variables(F&& fn) {" << std::endl;
+			header << TAB << TAB << TAB << "std::lock_guard<std::mutex> guard(variables_lock);" << std::endl;
+			header << TAB << TAB << TAB << "std::unique_ptr<variables> next(static_cast<variables*>(current_variables.load()->clone()));" << std::endl;
+			header << TAB << TAB << TAB << "fn(*next);" << std::endl;
+			if(ChainHasStatics(ast))
+				header << TAB << TAB << TAB << "this->render_static_into(*next);" << std::endl;
+			header << TAB << TAB << TAB << "publish_variables(next.release());" << std::endl;
+			header << TAB << TAB << "}" << std::endl;
 		}
 		for (auto& var : ast->get_variables()) {
-			header << TAB << TAB << "void set" << var->get_function_name() << "(" << var->get_type() << " " << var->get_name() << ") { this->" << var->get_name() << " = " << var->get_name() << "; }" << std::endl;
+			if(atomic) {
+				header << TAB << TAB << "void set" << var->get_function_name() << "(" << var->get_type() << " " << var->get_name() << ") { update_variables([&](variables& next_variables) { next_variables." << var->get_name() << " = std::move(" << var->get_name() << "); }); }" << std::endl;
+				header << TAB << TAB << var->get_type() << " get" << var->get_function_name() << "() const { variables_snapshot pinned(*this); return static_cast<const variables&>(*pinned)." << var->get_name() << "; }" << std::endl;
+				continue;
+			}
+			header << TAB << TAB << "void set" << var->get_function_name() << "(" << var->get_type() << " " << var->get_name() << ") { this->" << var->get_name() << " = " << var->get_name() << ";" << (ChainHasStatics(ast) ? " this->render_static();" : "") << " }" << std::endl;
 			header << TAB << TAB << var->get_type() << " get" << var->get_function_name() << "() const { return this->" << var->get_name() << "; }" << std::endl;
 		}
+		if(baseast && !StaticSections(ast).empty() && !ChainHasStatics(baseast)) {
+			// Setters of the bases know nothing of our sections, hide them with ones rendering them again.
+			// With a snapshot ours updates the variable of the base, so both are published at once.
+			for(ASTPtr l = baseast; l; l = l->is_base_ast() ? nullptr : std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast()) {
+				for(auto& var : l->get_variables()) {
+					header << TAB << TAB << "void set" << var->get_function_name() << "(" << var->get_type() << " " << var->get_name() << ") { ";
+					if(atomic)
+						header << "update_variables([&](variables& next_variables) { static_cast<::" << l->get_namespace() << "::" << l->get_classname() << "::variables&>(next_variables)."
+							<< var->get_name() << " = std::move(" << var->get_name() << "); }); }" << std::endl;
+					else
+						header << l->get_classname() << "::set" << var->get_function_name() << "(std::move(" << var->get_name() << ")); this->render_static(); }" << std::endl;
+				}
+			}
+		}
 		header << TAB << "protected:" << std::endl;
-		for (auto& var : ast->get_variables()) {
-			header << TAB << TAB << var->get_type() << " " << var->get_name() << " {}; // " << var->get_function_name() << std::endl;
+		if(options.json)
+			header << TAB << TAB << "class json_reader;" << std::endl;
+		if(owner) {
+			header << TAB << TAB << "std::atomic<variables*> current_variables { new variables() };" << std::endl;
+			// Readers on either side of the epoch, a setter flips it and waits for the old side to drain
+			header << TAB << TAB << "mutable std::atomic<size_t> variables_readers[2] {};" << std::endl;
+			header << TAB << TAB << "mutable std::atomic<uint64_t> variables_epoch { 0 };" << std::endl;
+			header << TAB << TAB << "std::mutex variables_lock {};" << std::endl;
+			header << TAB << TAB << "void publish_variables(variables* next);" << std::endl;
+		} else if(!atomic) {
+			for (auto& var : ast->get_variables()) {
+				header << TAB << TAB << var->get_type() << " " << var->get_name() << " {}; // " << var->get_function_name() << std::endl;
+			}
+			for(auto& name : StaticMembers(ast, options))
+				header << TAB << TAB << "std::string " << name << " {};" << std::endl;
+		}
+		// Renders the static sections of the whole chain again, after init and whenever a variable changes.
+		// Declared by the first template of the chain with sections, templates without any have no need for it.
+		// With a snapshot the sections render into the next one while it is updated, render_static publishes it.
+		if(!StaticSections(ast).empty()) {
+			bool first = !(baseast && ChainHasStatics(baseast));
+			if(atomic && first)
+				header << TAB << TAB << "void render_static();" << std::endl;
+			if(atomic)
+				header << TAB << TAB << (first ? "virtual " : "") << "void render_static_into(" << SnapshotType(ast, options) << "& next_variables)" << (first ? "" : " override") << ";" << std::endl;
+			else if(first)
+				header << TAB << TAB << "virtual void render_static();" << std::endl;
+			else
+				header << TAB << TAB << "void render_static() override;" << std::endl;
 		}
 		header << std::endl;
+		if(ast->is_base_ast() && options.batch) {
+			// Renders a single params of a batch, the type check and hooks are up to the caller
+			header << TAB << TAB << "typedef void (" << ast->get_classname() << "::*batch_render)(std::string& str, base_params& p) const;" << std::endl;
+			if(options.catalogs.empty())
+				header << TAB << TAB << "void render_body(std::string& str, base_params& p) const;" << std::endl;
+			header << TAB << TAB << "std::vector<size_t> run_batch(size_t count, std::string& out, bool parallel, bool hooks," << std::endl;
+			header << TAB << TAB << TAB << "const std::function<base_params&(size_t)>& at, batch_render fn) const;" << std::endl;
+			header << std::endl;
+		}
+		if(executor) {
+			header << TAB << TAB << "executor_type executor {};" << std::endl;
+			header << std::endl;
+			// Tasks of a single render. A task runs on whichever thread claims it first, a worker or the render waiting
+			// for it, so waiting never blocks on a task that is only queued and nested parallel work can't deadlock.
+			header << TAB << TAB << "class render_tasks" << std::endl;
+			header << TAB << TAB << "{" << std::endl;
+			header << TAB << TAB << TAB << "struct task" << std::endl;
+			header << TAB << TAB << TAB << "{" << std::endl;
+			header << TAB << TAB << TAB << TAB << "std::atomic<bool> claimed { false };" << std::endl;
+			header << TAB << TAB << TAB << TAB << "std::function<void()> fn;" << std::endl;
+			header << TAB << TAB << TAB << TAB << "std::promise<void> done {};" << std::endl;
+			header << TAB << TAB << TAB << TAB << "explicit task(std::function<void()> f) : fn(std::move(f)) {}" << std::endl;
+			header << TAB << TAB << TAB << TAB << "void run();" << std::endl;
+			header << TAB << TAB << TAB << "};" << std::endl;
+			header << TAB << TAB << TAB << "const executor_type& executor;" << std::endl;
+			header << TAB << TAB << TAB << "std::vector<std::shared_ptr<task>> tasks {};" << std::endl;
+			header << TAB << TAB << TAB << "std::vector<std::future<void>> results {};" << std::endl;
+			header << TAB << TAB << "public:" << std::endl;
+			header << TAB << TAB << TAB << "explicit render_tasks(const executor_type& e) : executor(e) {}" << std::endl;
+			header << TAB << TAB << TAB << "render_tasks(const render_tasks&) = delete;" << std::endl;
+			header << TAB << TAB << TAB << "render_tasks& operator=(const render_tasks&) = delete;" << std::endl;
+			header << TAB << TAB << TAB << "~render_tasks();" << std::endl;
+			header << TAB << TAB << TAB << "size_t run(std::function<void()> fn);" << std::endl;
+			header << TAB << TAB << TAB << "void get(size_t idx);" << std::endl;
+			header << TAB << TAB << "};" << std::endl;
+			header << std::endl;
+		}
+		if(ast->is_base_ast()) {
+			if(options.deflate) {
+				// Raw deflate of a literal ending on a byte boundary, with crc and length of the text
+				header << TAB << TAB << "struct deflate_literal" << std::endl;
+				header << TAB << TAB << "{" << std::endl;
+				header << TAB << TAB << TAB << "const char* data;" << std::endl;
+				header << TAB << TAB << TAB << "size_t size;" << std::endl;
+				header << TAB << TAB << TAB << "uint32_t crc;" << std::endl;
+				header << TAB << TAB << TAB << "uint32_t length;" << std::endl;
+				header << TAB << TAB << "};" << std::endl;
+				// Writes a gzip stream, dynamic output is buffered and compressed between literals
+				header << TAB << TAB << "class deflate_sink" << std::endl;
+				header << TAB << TAB << "{" << std::endl;
+				header << TAB << TAB << TAB << "std::string& out;" << std::endl;
+				header << TAB << TAB << TAB << "std::string pending {};" << std::endl;
+				header << TAB << TAB << TAB << "void* stream = nullptr;" << std::endl;
+				header << TAB << TAB << TAB << "bool dirty = false;" << std::endl;
+				header << TAB << TAB << TAB << "uint32_t crc = 0;" << std::endl;
+				header << TAB << TAB << TAB << "uint32_t size = 0;" << std::endl;
+				header << TAB << TAB << TAB << "void compress(bool align);" << std::endl;
+				header << TAB << TAB << "public:" << std::endl;
+				header << TAB << TAB << TAB << "explicit deflate_sink(std::string& o);" << std::endl;
+				header << TAB << TAB << TAB << "deflate_sink(const deflate_sink&) = delete;" << std::endl;
+				header << TAB << TAB << TAB << "deflate_sink& operator=(const deflate_sink&) = delete;" << std::endl;
+				header << TAB << TAB << TAB << "~deflate_sink();" << std::endl;
+				header << TAB << TAB << TAB << "template<typename... T>" << std::endl;
+				header << TAB << TAB << TAB << "void append(T&&... v) {" << std::endl;
+				header << TAB << TAB << TAB << TAB << "pending.append(std::forward<T>(v)...);" << std::endl;
+				header << TAB << TAB << TAB << TAB << "if(pending.size() >= 16384) compress(false);" << std::endl;
+				header << TAB << TAB << TAB << "}" << std::endl;
+				header << TAB << TAB << TAB << "void literal(const deflate_literal& lit);" << std::endl;
+				header << TAB << TAB << TAB << "void finish();" << std::endl;
+				header << TAB << TAB << "};" << std::endl;
+				header << std::endl;
+			}
+			if(options.hash) {
+				// Text of a literal with its crc and x^(8 * length) modulo the polynomial
+				header << TAB << TAB << "struct hash_literal" << std::endl;
+				header << TAB << TAB << "{" << std::endl;
+				header << TAB << TAB << TAB << "const char* data;" << std::endl;
+				header << TAB << TAB << TAB << "size_t length;" << std::endl;
+				header << TAB << TAB << TAB << "uint32_t crc;" << std::endl;
+				header << TAB << TAB << TAB << "uint32_t shift;" << std::endl;
+				header << TAB << TAB << "};" << std::endl;
+				// Hashes the output while appending it to out, or only hashes it if out is null
+				header << TAB << TAB << "class hash_sink" << std::endl;
+				header << TAB << TAB << "{" << std::endl;
+				header << TAB << TAB << TAB << "std::string* out;" << std::endl;
+				header << TAB << TAB << TAB << "uint32_t crc = 0xffffffff;" << std::endl;
+				header << TAB << TAB << TAB << "void update(const char* data, size_t length);" << std::endl;
+				header << TAB << TAB << TAB << "static uint32_t multiply(uint32_t a, uint32_t b);" << std::endl;
+				header << TAB << TAB << "public:" << std::endl;
+				header << TAB << TAB << TAB << "explicit hash_sink(std::string* o) : out(o) {}" << std::endl;
+				header << TAB << TAB << TAB << "hash_sink(const hash_sink&) = delete;" << std::endl;
+				header << TAB << TAB << TAB << "hash_sink& operator=(const hash_sink&) = delete;" << std::endl;
+				header << TAB << TAB << TAB << "void append(std::string_view v) {" << std::endl;
+				header << TAB << TAB << TAB << TAB << "update(v.data(), v.size());" << std::endl;
+				header << TAB << TAB << TAB << TAB << "if(out) out->append(v.data(), v.size());" << std::endl;
+				header << TAB << TAB << TAB << "}" << std::endl;
+				header << TAB << TAB << TAB << "void append(const char* s, size_t n) { append(std::string_view(s, n)); }" << std::endl;
+				header << TAB << TAB << TAB << "void literal(const hash_literal& lit);" << std::endl;
+				header << TAB << TAB << TAB << "uint32_t value() const { return ~crc; }" << std::endl;
+				header << TAB << TAB << "};" << std::endl;
+				header << std::endl;
+			}
+			if(!options.utf8.empty()) {
+				// Expression output is validated as it is appended, the compiler checked the static text
+				header << TAB << TAB << "static size_t utf8_sequence(const unsigned char* s, size_t n, size_t& invalid);" << std::endl;
+				header << TAB << TAB << "static size_t utf8_valid_prefix(const char* data, size_t n);" << std::endl;
+				// May return a view of replaced, the default argument lives until the end of the calling expression
+				header << TAB << TAB << "static std::string_view valid_utf8(std::string_view v, std::string&& replaced = std::string());" << std::endl;
+				header << TAB << TAB << "static void valid_utf8_tail(std::string& str, size_t start);" << std::endl;
+				header << std::endl;
+			}
+		}
+		if(options.deflate)
+			header << TAB << TAB << "static const deflate_literal deflate_literals[];" << std::endl;
+		if(options.hash)
+			header << TAB << TAB << "static const hash_literal hash_literals[];" << std::endl;
 		// Code handlers
 		header << TAB << TAB << "virtual const std::type_info& get_param_type() const;" << std::endl;
 		header << TAB << TAB << "virtual void prerender(base_params& p) const;" << std::endl;
 		header << TAB << TAB << "virtual void postrender(base_params& p) const;" << std::endl;
 
+		if(!options.catalogs.empty()) {
+			if(ast->is_base_ast()) {
+				for(auto& c : options.catalogs) {
+					for(auto& sink : SinkTypes(options))
+						header << TAB << TAB << "void render_" << c->get_identifier() << "(" << sink << "& str, base_params& p) const;" << std::endl;
+				}
+			} else {
+				header << TAB << TAB << "static_assert(locale_count == " << options.catalogs.size() << ", \"templates of an extends chain need the same catalogs\");" << std::endl;
+			}
+		}
 		for (auto& a : ast->get_blocks()) {
-			header << TAB << TAB << "virtual void renderBlock_" << a->get_name() << "(std::string& str, base_params& p) const;" << std::endl;
+			for(auto& sink : SinkTypes(options)) {
+				if(options.catalogs.empty())
+					header << TAB << TAB << "virtual void renderBlock_" << a->get_name() << "(" << sink << "& str, base_params& p) const;" << std::endl;
+				for(auto& c : options.catalogs)
+					header << TAB << TAB << "virtual void renderBlock_" << a->get_name() << "_" << c->get_identifier() << "(" << sink << "& str, base_params& p) const;" << std::endl;
+			}
 		}
 
 		if(ast->is_base_ast())
@@ -384,4 +2670,33 @@ namespace cpptemplate {
 
 		return header.str();
 	}
+
+	std::string Generator::GenerateParamsHeader(ASTPtr ast) {
+		// Only included where params are filled in or read, together with the includes their types need
+		std::ostringstream header;
+		header << "#pragma once" << std::endl;
+		header << "#include \"" << ast->get_classname() << ".h\"" << std::endl;
+		if(!ast->is_base_ast()) {
+			auto ext = std::dynamic_pointer_cast<ExtendingTemplateAST>(ast);
+			auto parts = split(ext->get_base_template(), "/");
+			parts.back() = ext->get_base_template_ast()->get_classname() + "_params.h";
+			header << "#include \"" << join("/", parts) << "\"" << std::endl;
+		}
+		for (auto& incl : ast->get_header_includes()) {
+			header << "#include " << incl << std::endl;
+		}
+		if(!ast->is_base_ast() && ast->get_parameters().empty())
+			return header.str();
+
+		for(auto& ns : split(ast->get_namespace(), "::"))
+		{
+			header << "namespace " << ns << " {" << std::endl;
+		}
+		header << BuildParamsStruct(ast, ast->get_classname() + "::params", "");
+		for(auto& ns : split(ast->get_namespace(), "::"))
+		{
+			header << "} // namespace " << ns << std::endl;
+		}
+		return header.str();
+	}
 }
\ No newline at end of file
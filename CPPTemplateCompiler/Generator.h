@@ -1,14 +1,117 @@
 #pragma once
 #include "AST.h"
+#include "Catalog.h"
+#include "CodeWriter.h"
+#include "Profile.h"
+#include <cstdint>
+#include <map>
+#include <set>
 
 namespace cpptemplate {
+	struct GeneratorOptions {
+		// Count branch and loop hits and dump them to $CPPTEMPLATE_PROFILE at exit
+		bool instrument = false;
+		// Counters of an instrumented run used to place branch hints, outline cold branches and reserve loop output
+		ProfilePtr profile {};
+		// Emit a streaming from_json for the params of the whole extends chain
+		bool json = false;
+		// Message catalogs to specialize render for, the first one is the default locale
+		std::vector<CatalogPtr> catalogs {};
+		// Emit render_deflate producing gzip output with static text compressed at compile time
+		bool deflate = false;
+		// Emit render_hashed and render_hash computing a CRC32C of the output while rendering
+		bool hash = false;
+		// Outline runs of nodes into functions of their own once a body exceeds this many statements, 0 to never split
+		size_t split_budget = 0;
+		// Define params in <classname>_params.h, the class header then only includes the template includes if it has variables
+		bool lean_header = false;
+		// Static text of at least this many bytes is read from a blob file instead of string literals, 0 to keep all text inline
+		size_t blob_threshold = 0;
+		// File name of the blob, #embed finds it next to the generated code and .incbin in the include path of the assembler
+		std::string blob_name {};
+		// Receives the content of the blob file, set by the caller together with blob_threshold
+		std::shared_ptr<std::string> blob {};
+		// Give templates and blocks rendering the same text for any params a constexpr accessor returning that text
+		bool prerender = false;
+		// Keep variables in an immutable snapshot behind an atomic pointer, so setters may run while other threads render
+		bool atomic_variables = false;
+		// Validate expression output as UTF-8 while appending it, "check" throws and "replace" substitutes U+FFFD, empty to append as is
+		std::string utf8 {};
+		// Name of the generated implementation as the C++ compiler sees it, if set statements get #line directives pointing at their template lines
+		std::string line_directives {};
+		// Emit render_batch rendering many params back to back into one string, optionally spread over the executor
+		bool batch = false;
+		// Catalog the code is currently generated for, set by the generator for each of catalogs
+		CatalogPtr locale {};
+		// Output type the code is currently generated for, empty for std::string
+		std::string sink {};
+		// Set by the generator for the body of a loop, only the outermost loop of a function reserves its output
+		bool in_loop = false;
+		// Names bound by the lets and loops enclosing the code currently generated, set by the generator
+		std::set<std::string> scoped {};
+		// Set by the generator where the function pinned a snapshot of the variables, its tasks share the pin
+		bool pinned = false;
+		// Static text of the deflate sink by content, indices into deflate_literals filled while generating
+		std::shared_ptr<std::map<std::string, size_t>> deflate_literals {};
+		// Offsets of static text in blob by content, filled while generating
+		std::shared_ptr<std::map<std::string, size_t>> blob_literals {};
+		// Static text of the hash sink by content, indices into hash_literals filled while generating
+		std::shared_ptr<std::map<std::string, size_t>> hash_literals {};
+		// Statements counted for nodes while splitting render functions, filled while generating
+		std::shared_ptr<std::map<NodePtr, size_t>> statements {};
+	};
+
 	class Generator {
 		static std::string BuildParamsBlock(ASTPtr ast);
+		static std::string BuildParamsStruct(ASTPtr ast, const std::string& name, const std::string& indent);
 		static std::string SanitizePlainText(const std::string& str);
-		static NodePtr ReplaceMacros(NodePtr n, ASTPtr ast);
-		static std::string BuildActionRender(std::vector<NodePtr> nodes, ASTPtr ast, ASTPtr baseast, const std::string& cblock = "", size_t nindent = 0);
+		static std::string SanitizeBinary(const std::string& str);
+		static std::string CompressLiteral(const std::string& str);
+		static void HashLiteral(const std::string& str, uint32_t& crc, uint32_t& shift);
+		static std::vector<std::string> SinkTypes(const GeneratorOptions& options);
+		static std::string BlobSymbol(ASTPtr ast);
+		static std::string BuildLiteralData(const std::string& str, ASTPtr ast, const GeneratorOptions& options);
+		static bool PrerenderNodes(const std::vector<NodePtr>& nodes, ASTPtr ast, ASTPtr level, std::string& out);
+		static std::string BlockFunction(const std::string& name, const GeneratorOptions& options);
+		static void CollectBlockCalls(const std::vector<NodePtr>& nodes, std::vector<BlockCallNodePtr>& res);
+		static uint64_t StaticBytes(const std::vector<NodePtr>& nodes);
+		static uint64_t ProfiledLoopBytes(const std::vector<NodePtr>& nodes, ASTPtr ast, const GeneratorOptions& options);
+		static void CollectStatics(const std::vector<NodePtr>& nodes, std::vector<StaticNodePtr>& res);
+		static std::vector<StaticNodePtr> StaticSections(ASTPtr ast);
+		static bool ChainHasStatics(ASTPtr ast);
+		static std::vector<std::string> StaticMembers(ASTPtr ast, const GeneratorOptions& options);
+		static bool ParallelNodes(const std::vector<NodePtr>& nodes);
+		static bool OwnsExecutor(ASTPtr ast, const GeneratorOptions& options);
+		static bool OwnsDeferred(ASTPtr ast);
+		static bool HasSnapshot(ASTPtr ast, const GeneratorOptions& options);
+		static ASTPtr SnapshotLevel(ASTPtr ast, const GeneratorOptions& options);
+		static bool OwnsSnapshot(ASTPtr ast, const GeneratorOptions& options);
+		static std::string SnapshotType(ASTPtr ast, const GeneratorOptions& options);
+		static std::string BindVariables(ASTPtr ast, const GeneratorOptions& options, const std::string& snapshot, const std::string& indent);
+		static void CheckStaticText(const std::vector<NodePtr>& nodes, ASTPtr ast, const GeneratorOptions& options);
+		static std::vector<NodePtr> Localize(const std::vector<NodePtr>& nodes, ASTPtr ast, CatalogPtr catalog);
+		static std::set<std::string> Identifiers(const std::string& code);
+		static std::vector<NodePtr> ShareExpression(const std::vector<NodePtr>& nodes, const std::string& code, const std::string& name, size_t& count);
+		static std::vector<NodePtr> ShareExpressions(const std::vector<NodePtr>& nodes);
+		static std::vector<std::pair<std::string, std::string>> InvariantExpressions(const std::vector<NodePtr>& nodes, std::set<std::string> bound);
+		static std::string LineDirective(size_t line, ASTPtr ast);
+		static void BuildCodeBlock(CodeWriter& impl, CodeBlockPtr code, ASTPtr ast, const GeneratorOptions& options);
+		static void BuildProbe(CodeWriter& impl, ASTPtr ast, NodePtr node, size_t index, size_t nindent = 0);
+		static void BuildBranch(CodeWriter& impl, std::vector<NodePtr> nodes, ASTPtr ast, ASTPtr baseast, const GeneratorOptions& options, const std::string& cblock, size_t nindent, bool cold);
+		static std::string BuildJsonReader(ASTPtr ast);
+		static size_t Statements(NodePtr node, const GeneratorOptions& options);
+		static void BuildActionRender(CodeWriter& impl, std::vector<NodePtr> nodes, ASTPtr ast, ASTPtr baseast, const GeneratorOptions& options, const std::string& cblock = "", size_t nindent = 0);
 	public:
-		static std::string GenerateImplementation(ASTPtr ast);
-		static std::string GenerateHeader(ASTPtr ast);
+		static NodePtr ReplaceMacros(NodePtr n, ASTPtr ast);
+		static std::string AwaitParams(const std::string& code, ASTPtr ast, const std::set<std::string>& shadowed = {});
+		static std::string BuildVariablesBlock(ASTPtr ast, const GeneratorOptions& options, const std::string& indent);
+		static std::string StaticSection(ASTPtr ast, size_t index, const GeneratorOptions& options);
+		static std::string GenerateImplementation(ASTPtr ast, const GeneratorOptions& options = GeneratorOptions());
+		static void GenerateImplementation(std::ostream& out, ASTPtr ast, const GeneratorOptions& options = GeneratorOptions());
+		static std::string GenerateHeader(ASTPtr ast, const GeneratorOptions& options = GeneratorOptions());
+		static std::string GenerateParamsHeader(ASTPtr ast);
+		static bool Prerender(ASTPtr ast, std::string& out);
+		static bool PrerenderBlock(ASTPtr ast, const std::string& name, std::string& out);
+		static std::string CompressGzip(const std::string& str);
 	};
 }
\ No newline at end of file
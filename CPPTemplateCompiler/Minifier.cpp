@@ -0,0 +1,113 @@
+#include "Minifier.h"
+#include <cctype>
+
+namespace cpptemplate {
+	static const char* RAW_ELEMENTS[] = { "pre", "textarea", "script", "style" };
+
+	static bool MatchTag(const std::string& text, size_t pos, const std::string& name) {
+		if(text.size() - pos < name.size()) return false;
+		for(size_t i = 0; i < name.size(); i++)
+			if(tolower(static_cast<unsigned char>(text[pos + i])) != name[i]) return false;
+		// <pre> but not <prefix>
+		pos += name.size();
+		return pos == text.size() || isspace(static_cast<unsigned char>(text[pos])) || text[pos] == '>' || text[pos] == '/';
+	}
+
+	std::string Minifier::MinifyText(const std::string& text, State& state) {
+		std::string res;
+		res.reserve(text.size());
+		size_t i = 0;
+		while(i < text.size()) {
+			if(!state.raw.empty()) {
+				auto close = i;
+				while((close = text.find("</", close)) != std::string::npos && !MatchTag(text, close + 2, state.raw)) close += 2;
+				if(close == std::string::npos) {
+					res.append(text, i, std::string::npos);
+					break;
+				}
+				res.append(text, i, close - i);
+				i = close;
+				state.raw.clear();
+			}
+			char c = text[i];
+			if(c == '<') {
+				// Conditional comments are markup for old browsers and have to stay
+				if(text.compare(i, 4, "<!--") == 0 && text.compare(i, 5, "<!--[") != 0 && text.compare(i, 6, "<!--<!") != 0) {
+					auto end = text.find("-->", i + 4);
+					// A comment around dynamic content is left alone, we can not drop the expression
+					if(end != std::string::npos) {
+						i = end + 3;
+						continue;
+					}
+				}
+				for(auto name : RAW_ELEMENTS) {
+					if(MatchTag(text, i + 1, name)) state.raw = name;
+				}
+				res += c;
+				i++;
+			} else if(isspace(static_cast<unsigned char>(c))) {
+				auto end = i;
+				bool newline = false;
+				while(end < text.size() && isspace(static_cast<unsigned char>(text[end]))) {
+					newline = newline || text[end] == '\n';
+					end++;
+				}
+				// Indentation between tags goes away, anything else might be significant and becomes a single space
+				bool between_tags = !res.empty() && res.back() == '>' && end < text.size() && text[end] == '<';
+				if(!(newline && between_tags)) res += ' ';
+				i = end;
+			} else {
+				res += c;
+				i++;
+			}
+		}
+		return res;
+	}
+
+	void Minifier::MinifyNodes(const std::vector<NodePtr>& nodes, ASTPtr ast, State& state) {
+		for(auto& n : nodes) {
+			switch(n->get_type()) {
+				case NodeType::AppendString: {
+					auto node = std::dynamic_pointer_cast<AppendStringNode>(n);
+					node->set_data(MinifyText(node->get_data(), state));
+					break;
+				}
+				case NodeType::BlockCall: {
+					// Blocks of the base template are minified where they appear in the document
+					auto block = ast->get_block(std::dynamic_pointer_cast<BlockCallNode>(n)->get_block());
+					if(block) MinifyNodes(block->get_nodes(), ast, state);
+					break;
+				}
+				case NodeType::ForEachLoop:
+					MinifyNodes(std::dynamic_pointer_cast<ForEachLoopNode>(n)->get_nodes(), ast, state);
+					break;
+				case NodeType::Let:
+					MinifyNodes(std::dynamic_pointer_cast<LetNode>(n)->get_nodes(), ast, state);
+					break;
+				case NodeType::Static:
+					MinifyNodes(std::dynamic_pointer_cast<StaticNode>(n)->get_nodes(), ast, state);
+					break;
+				case NodeType::Conditional: {
+					auto cn = std::dynamic_pointer_cast<ConditionNode>(n);
+					for(auto& b : cn->get_branches())
+						MinifyNodes(b.second, ast, state);
+					MinifyNodes(cn->get_else_branch(), ast, state);
+					break;
+				}
+				default: break;
+			}
+		}
+	}
+
+	void Minifier::MinifyAST(ASTPtr ast) {
+		State state;
+		if(ast->is_base_ast()) {
+			MinifyNodes(std::dynamic_pointer_cast<BaseTemplateAST>(ast)->get_nodes(), ast, state);
+		} else {
+			for(auto& b : ast->get_blocks()) {
+				state = State();
+				MinifyNodes(b->get_nodes(), ast, state);
+			}
+		}
+	}
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include "AST.h"
+
+namespace cpptemplate {
+	// Shrinks the literal text of HTML templates: comments are stripped, runs of
+	// whitespace collapse to a single space and indentation between two tags is
+	// dropped. Content of <pre>, <textarea>, <script> and <style> is kept as is.
+	class Minifier {
+		struct State {
+			// Element whose content is kept verbatim, empty outside of one
+			std::string raw {};
+		};
+
+		static std::string MinifyText(const std::string& text, State& state);
+		static void MinifyNodes(const std::vector<NodePtr>& nodes, ASTPtr ast, State& state);
+	public:
+		static void MinifyAST(ASTPtr ast);
+	};
+}
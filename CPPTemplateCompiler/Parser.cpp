@@ -23,7 +23,11 @@ namespace cpptemplate {
 			INCLUDE_CPP_HEADER,
 			INCLUDE_CPP_IMPL,
 			COMMENT,
-			CODE
+			CODE,
+			TRANSLATION,
+			LET,
+			BEGIN_STATIC,
+			END_STATIC
 		};
 		Type type;
 		std::vector<std::string> args;
@@ -40,13 +44,23 @@ namespace cpptemplate {
 		bool in_code_section = false;
 		std::string cblock;
 		std::vector<Token> tokens;
+		// Set by a -%} or -}} marker, whitespace following the tag is dropped up to the next text
+		bool trim_next = false;
+		auto push_text = [&](std::string text, size_t line, size_t col) {
+			if (trim_next) {
+				ltrim(text);
+				if (text.empty()) return;
+				trim_next = false;
+			}
+			tokens.push_back({ Token::APPENDSTRING, { text }, line, col });
+		};
 		while (std::getline(stream, sline)) {
 			size_t offset = 0;
 			while (offset < sline.size()) {
 				if (!in_comment_section && !in_code_section) {
 					auto pos = std::min(sline.find("{%", offset), std::min(sline.find("{{", offset), sline.find("{#", offset)));
 					if (pos == std::string::npos) {
-						tokens.push_back({ Token::APPENDSTRING, { sline.substr(offset) + "\n" }, cnt_line, offset });
+						push_text(sline.substr(offset) + "\n", cnt_line, offset);
 						break;
 					}
 					if (sline.substr(pos, 2) == "{#") {
@@ -64,16 +78,32 @@ namespace cpptemplate {
 						if (trim_copy(sline.substr(endpos + 2)).empty()) {
 							if (!(remove_expression_only_lines && is_cmd && trim_copy(sline.substr(endpos + 2)).empty())) {
 								std::string plain = sline.substr(offset, pos - offset);
-								tokens.push_back({ Token::APPENDSTRING, { plain }, cnt_line, offset });
+								push_text(plain, cnt_line, offset);
 							}
 						}
 						else {
 							std::string plain = sline.substr(offset, pos - offset);
-							tokens.push_back({ Token::APPENDSTRING, { plain }, cnt_line, offset });
+							push_text(plain, cnt_line, offset);
+						}
+					}
+					trim_next = false;
+					// {%- and {{- strip the whitespace before the tag, -%} and -}} the whitespace after it
+					auto inner_begin = pos + 2;
+					auto inner_end = endpos;
+					if (inner_begin < inner_end && sline[inner_begin] == '-') {
+						inner_begin++;
+						while (!tokens.empty() && tokens.back().type == Token::APPENDSTRING) {
+							rtrim(tokens.back().args[0]);
+							if (!tokens.back().args[0].empty()) break;
+							tokens.pop_back();
 						}
 					}
+					if (inner_begin < inner_end && sline[inner_end - 1] == '-') {
+						inner_end--;
+						trim_next = true;
+					}
 					if (is_cmd) {
-						std::string command = sline.substr(pos + 2, endpos - pos - 2);
+						std::string command = sline.substr(inner_begin, inner_end - inner_begin);
 						auto parts = split(command, " ");
 						if (parts[0] == "variable") {
 							tokens.push_back({ Token::VARIABLE, { parts[1], parts[2], join(" ", parts, 3) }, cnt_line, offset });
@@ -94,7 +124,17 @@ namespace cpptemplate {
 							tokens.push_back({ Token::INCLUDE_CPP_IMPL, { join(" ", parts, 1) }, cnt_line, offset });
 						}
 						else if (parts[0] == "for") {
-							tokens.push_back({ Token::FOREACH_LOOP, { parts[1], parts[3] }, cnt_line, offset });
+							std::string grain;
+							if (parts.size() > 4) {
+								if (parts[4] != "parallel")
+									throw std::runtime_error("unknown loop attribute " + parts[4] + " at " + std::to_string(cnt_line+1) + ":" + std::to_string(offset));
+								if (parts.size() > 5) {
+									if (!startsWith(parts[5], "grain=") || parts[5].size() == 6 || parts[5].find_first_not_of("0123456789", 6) != std::string::npos || std::stoul(parts[5].substr(6)) == 0)
+										throw std::runtime_error("invalid loop grain " + parts[5] + " at " + std::to_string(cnt_line+1) + ":" + std::to_string(offset));
+									grain = parts[5].substr(6);
+								}
+							}
+							tokens.push_back({ Token::FOREACH_LOOP, { parts[1], parts[3], parts.size() > 4 ? parts[4] : "", grain }, cnt_line, offset });
 						}
 						else if (parts[0] == "endfor") {
 							tokens.push_back({ Token::END_LOOP, {}, cnt_line, offset });
@@ -112,8 +152,10 @@ namespace cpptemplate {
 							tokens.push_back({ Token::END_CONDITIONAL, {}, cnt_line, offset });
 						}
 						else if (parts[0] == "block") {
+							if (parts.size() > 2 && parts[2] != "parallel")
+								throw std::runtime_error("unknown block attribute " + parts[2] + " at " + std::to_string(cnt_line+1) + ":" + std::to_string(offset));
 							cblock = parts[1];
-							tokens.push_back({ Token::BEGIN_BLOCK, { parts[1] }, cnt_line, offset });
+							tokens.push_back({ Token::BEGIN_BLOCK, { parts[1], parts.size() > 2 ? parts[2] : "" }, cnt_line, offset });
 						}
 						else if (parts[0] == "endblock") {
 							cblock = "";
@@ -122,6 +164,22 @@ namespace cpptemplate {
 						else if (parts[0] == "parent()" && !cblock.empty()) {
 							tokens.push_back({ Token::BLOCK_PARENT, { cblock }, cnt_line, offset });
 						}
+						else if (parts[0] == "trans") {
+							if (parts.size() != 2)
+								throw std::runtime_error("trans expects a single key at " + std::to_string(cnt_line+1) + ":" + std::to_string(offset));
+							tokens.push_back({ Token::TRANSLATION, { parts[1] }, cnt_line, offset });
+						}
+						else if (parts[0] == "let") {
+							if (parts.size() < 4 || parts[2] != "=")
+								throw std::runtime_error("let expects name = expression at " + std::to_string(cnt_line+1) + ":" + std::to_string(offset));
+							tokens.push_back({ Token::LET, { parts[1], join(" ", parts, 3) }, cnt_line, offset });
+						}
+						else if (parts[0] == "static") {
+							tokens.push_back({ Token::BEGIN_STATIC, {}, cnt_line, offset });
+						}
+						else if (parts[0] == "endstatic") {
+							tokens.push_back({ Token::END_STATIC, {}, cnt_line, offset });
+						}
 						else if (parts[0] == "init" || parts[0] == "deinit" || parts[0] == "prerender" || parts[0] == "postrender") {
 							in_code_section = true;
 							tokens.push_back({ Token::CODE, { parts[0], "" }, cnt_line, offset });
@@ -130,7 +188,7 @@ namespace cpptemplate {
 						offset = endpos + 2;
 					}
 					else {
-						tokens.push_back({ Token::EXPRESSION, { sline.substr(pos + 2, endpos - pos - 2) }, cnt_line, offset });
+						tokens.push_back({ Token::EXPRESSION, { sline.substr(inner_begin, inner_end - inner_begin) }, cnt_line, offset });
 						offset = endpos + 2;
 					}
 				}
@@ -167,6 +225,8 @@ namespace cpptemplate {
 								offset = moffset;
 							}
 						}
+						// The code starts on the line following its tag unless text follows the tag
+						if(tokens.back().args[1].empty()) tokens.back().source_line = cnt_line;
 						if(!is_end) {
 							tokens.back().args[1] += sline.substr(offset) + "\n";
 							offset = sline.size();
@@ -209,6 +269,7 @@ namespace cpptemplate {
 			if(it->type == Token::BEGIN_BLOCK) {
 				auto block = std::make_shared<Block>();
 				block->set_name(it->args[0]);
+				block->set_parallel(it->args[1] == "parallel");
 				it++;
 				while(it != tokens.end()) {
 					if(it->type == Token::END_BLOCK)
@@ -221,6 +282,7 @@ namespace cpptemplate {
 							block->add_node(node);
 					}
 				}
+				block->set_nodes(ScopeLets(block->get_nodes()));
 				ptr->add_block(block);
 				auto bnode = std::make_shared<BlockCallNode>();
 				bnode->set_block(block->get_name());
@@ -252,6 +314,7 @@ namespace cpptemplate {
 				auto code = std::make_shared<CodeBlock>();
 				code->set_name(it->args[0]);
 				code->set_code(it->args[1]);
+				code->set_source_line(it->source_line + 1);
 				ptr->add_codeblock(code);
 				it++;
 			} else {
@@ -260,6 +323,11 @@ namespace cpptemplate {
 					ptr->add_node(node);
 			}
 		}
+		ptr->set_nodes(ScopeLets(ptr->get_nodes()));
+		size_t statics = 0;
+		NumberStatics(ptr->get_nodes(), statics);
+		for(auto& b : ptr->get_blocks())
+			NumberStatics(b->get_nodes(), statics);
 		return ptr;
 	}
 
@@ -269,6 +337,9 @@ namespace cpptemplate {
 			if(it->type == Token::BEGIN_BLOCK) {
 				auto block = std::make_shared<Block>();
 				block->set_name(it->args[0]);
+				// Overrides run wherever the base dispatches its block, in parallel or not
+				if(it->args[1] == "parallel")
+					throw std::runtime_error("parallel can only be declared by the base template of block " + it->args[0] + " at " + std::to_string(it->source_line + 1) + ":" + std::to_string(it->source_col));
 				it++;
 				while(it != tokens.end()) {
 					if(it->type == Token::END_BLOCK)
@@ -281,6 +352,7 @@ namespace cpptemplate {
 							block->add_node(node);
 					}
 				}
+				block->set_nodes(ScopeLets(block->get_nodes()));
 				ptr->add_block(block);
 				it++;
 			} else if(it->type == Token::NAMESPACE) {
@@ -312,27 +384,48 @@ namespace cpptemplate {
 				auto code = std::make_shared<CodeBlock>();
 				code->set_name(it->args[0]);
 				code->set_code(it->args[1]);
+				code->set_source_line(it->source_line + 1);
 				ptr->add_codeblock(code);
 				it++;
 			} else {
 				throw std::runtime_error("extending templates do not allow free statements");
 			}
 		}
+		size_t statics = 0;
+		for(auto& b : ptr->get_blocks())
+			NumberStatics(b->get_nodes(), statics);
 		return ptr;
 	}
 
 	NodePtr Parser::BuildNode(std::vector<Token>::const_iterator& it, std::vector<Token>::const_iterator end) {
 		NodePtr ptr;
+		auto line = it->source_line + 1;
+		auto col = it->source_col;
 		switch(it->type) {
 			case Token::APPENDSTRING: ptr = std::make_shared<AppendStringNode>(it->args[0]); it++; break;
 			case Token::FOREACH_LOOP: ptr = BuildForEachNode(it, end); break;
-			case Token::EXPRESSION: ptr = std::make_shared<ExpressionNode>(it->args[0]); it++; break;
+			case Token::EXPRESSION: {
+				auto node = std::make_shared<ExpressionNode>(it->args[0]);
+				auto code = trim_copy(it->args[0]);
+				if(startsWith(code, "pure ")) {
+					node->set_code(code.substr(5));
+					node->set_pure(true);
+				}
+				ptr = node;
+				it++;
+				break;
+			}
 			case Token::CONDITIONAL: ptr = BuildConditionNode(it, end); break;
 			case Token::BLOCK_PARENT: ptr = std::make_shared<BlockParentCallNode>(it->args[0]); it++; break;
+			case Token::TRANSLATION: ptr = std::make_shared<TranslationNode>(it->args[0]); it++; break;
+			case Token::LET: ptr = std::make_shared<LetNode>(it->args[0], it->args[1]); it++; break;
+			case Token::BEGIN_STATIC: ptr = BuildStaticNode(it, end); break;
 			case Token::COMMENT: it++; break; // Ignore comments
 			default:
 				throw std::runtime_error("Unknown block:" + std::to_string((int)it->type));
 		}
+		if(ptr)
+			ptr->set_source_location(line, col);
 		return ptr;
 	}
 
@@ -340,6 +433,9 @@ namespace cpptemplate {
 		auto ptr = std::make_shared<ForEachLoopNode>();
 		ptr->set_source(it->args[1]);
 		ptr->set_variable_name(it->args[0]);
+		ptr->set_parallel(it->args[2] == "parallel");
+		if(!it->args[3].empty())
+			ptr->set_grain(std::stoul(it->args[3]));
 		std::vector<NodePtr> nodes;
 		it++;
 		while(it != end) {
@@ -351,7 +447,7 @@ namespace cpptemplate {
 			if(node)
 				nodes.push_back(node);
 		}
-		ptr->set_nodes(nodes);
+		ptr->set_nodes(ScopeLets(nodes));
 		return ptr;
 	}
 
@@ -363,23 +459,23 @@ namespace cpptemplate {
 		while(it != end) {
 			if(it->type == Token::END_CONDITIONAL) {
 				if(condition.empty()) {
-					ptr->set_else(nodes);
+					ptr->set_else(ScopeLets(nodes));
 				} else {
-					ptr->add_branch(condition, nodes);
+					ptr->add_branch(condition, ScopeLets(nodes));
 				}
 				it++;
 				break;
 			} else if(it->type == Token::CONDITIONAL_ELSEIF) {
 				if(condition.empty())
 					throw std::runtime_error("Invalid conditional");
-				ptr->add_branch(condition, nodes);
+				ptr->add_branch(condition, ScopeLets(nodes));
 				condition = it->args[0];
 				nodes.clear();
 				it++;
 			} else if(it->type == Token::CONDITIONAL_ELSE) {
 				if(condition.empty())
 					throw std::runtime_error("Invalid conditional");
-				ptr->add_branch(condition, nodes);
+				ptr->add_branch(condition, ScopeLets(nodes));
 				condition.clear();
 				nodes.clear();
 				it++;
@@ -392,6 +488,62 @@ namespace cpptemplate {
 		return ptr;
 	}
 
+	StaticNodePtr Parser::BuildStaticNode(std::vector<Token>::const_iterator& it, std::vector<Token>::const_iterator end) {
+		auto ptr = std::make_shared<StaticNode>();
+		std::vector<NodePtr> nodes;
+		it++;
+		while(it != end) {
+			if(it->type == Token::END_STATIC) {
+				it++;
+				break;
+			}
+			// Rendered without params, so nothing that needs them can be part of it
+			if(it->type == Token::BEGIN_BLOCK || it->type == Token::BLOCK_PARENT || it->type == Token::BEGIN_STATIC)
+				throw std::runtime_error("static sections can not contain blocks or other static sections at " + std::to_string(it->source_line + 1) + ":" + std::to_string(it->source_col));
+			auto node = BuildNode(it, end);
+			if(node)
+				nodes.push_back(node);
+		}
+		ptr->set_nodes(ScopeLets(nodes));
+		return ptr;
+	}
+
+	void Parser::NumberStatics(const std::vector<NodePtr>& nodes, size_t& count) {
+		for(auto& n : nodes) {
+			switch(n->get_type()) {
+				case NodeType::Static:
+					std::dynamic_pointer_cast<StaticNode>(n)->set_index(count++);
+					break;
+				case NodeType::ForEachLoop:
+					NumberStatics(std::dynamic_pointer_cast<ForEachLoopNode>(n)->get_nodes(), count);
+					break;
+				case NodeType::Let:
+					NumberStatics(std::dynamic_pointer_cast<LetNode>(n)->get_nodes(), count);
+					break;
+				case NodeType::Conditional: {
+					auto cn = std::dynamic_pointer_cast<ConditionNode>(n);
+					for(auto& b : cn->get_branches())
+						NumberStatics(b.second, count);
+					NumberStatics(cn->get_else_branch(), count);
+					break;
+				}
+				default: break;
+			}
+		}
+	}
+
+	std::vector<NodePtr> Parser::ScopeLets(std::vector<NodePtr> nodes) {
+		// A binding is visible up to the end of its scope, the nodes after it become its children
+		for(size_t i = 0; i < nodes.size(); i++) {
+			if(nodes[i]->get_type() != NodeType::Let) continue;
+			auto let = std::dynamic_pointer_cast<LetNode>(nodes[i]);
+			let->set_nodes(ScopeLets(std::vector<NodePtr>(nodes.begin() + i + 1, nodes.end())));
+			nodes.resize(i + 1);
+			break;
+		}
+		return nodes;
+	}
+
 	void Parser::DumpNode(std::ostream& str, NodePtr n, size_t indent) {
 		std::string tabs;
 		for(size_t i=0; i<indent; i++) tabs += "\t";
@@ -405,7 +557,7 @@ namespace cpptemplate {
 			}
 			case NodeType::Expression: {
 				auto epn = std::dynamic_pointer_cast<ExpressionNode>(n);
-				str << "Expression (" << epn->get_code().size() << " bytes code)";
+				str << "Expression (" << epn->get_code().size() << " bytes code" << (epn->is_pure() ? ", pure" : "") << ")";
 				break;
 			}
 			case NodeType::BlockCall: {
@@ -418,9 +570,30 @@ namespace cpptemplate {
 				str << "BlockParentCall " << node->get_block();
 				break;
 			}
+			case NodeType::Translation: {
+				auto node = std::dynamic_pointer_cast<TranslationNode>(n);
+				str << "Translation " << node->get_key();
+				break;
+			}
+			case NodeType::Let: {
+				auto node = std::dynamic_pointer_cast<LetNode>(n);
+				str << "Let " << node->get_name() << " = " << node->get_code() << std::endl;
+				for(auto& e : node->get_nodes())
+					DumpNode(str, e, indent + 1);
+				break;
+			}
+			case NodeType::Static: {
+				auto node = std::dynamic_pointer_cast<StaticNode>(n);
+				str << "Static " << node->get_index() << std::endl;
+				for(auto& e : node->get_nodes())
+					DumpNode(str, e, indent + 1);
+				break;
+			}
 			case NodeType::ForEachLoop: {
 				auto node = std::dynamic_pointer_cast<ForEachLoopNode>(n);
-				str << "ForEachLoop " << node->get_variable_name() << " in " << node->get_source() << std::endl;
+				str << "ForEachLoop " << node->get_variable_name() << " in " << node->get_source();
+				if(node->is_parallel()) str << " (parallel, grain " << node->get_grain() << ")";
+				str << std::endl;
 				for(auto& e: node->get_nodes())
 					DumpNode(str, e, indent + 1);
 				break;
@@ -444,7 +617,7 @@ namespace cpptemplate {
 		str << std::endl;
 	}
 
-	ASTPtr Parser::ParseStream(std::istream& str, const std::string& fname) {
+	ASTPtr Parser::ParseStream(std::istream& str, const std::string& fname, const ASTLoader& loader) {
 		auto tokens = Tokenize(str);
 		CompactTokens(tokens);
 		auto ast = BuildAST(tokens);
@@ -458,22 +631,24 @@ namespace cpptemplate {
 		}
 		if(!ast->is_base_ast()) {
 			auto ext = std::dynamic_pointer_cast<ExtendingTemplateAST>(ast);
-			std::string extname = ext->get_base_template();
-			if(!startsWith(extname, "/")) {
-				auto fnameparts = split(fname, "/", false);
-				if(fnameparts.empty()) throw std::runtime_error("invalid template filename");
-				fnameparts.erase(fnameparts.begin() + fnameparts.size() - 1); // Remove filename
-				extname = join("/", fnameparts) + "/" + extname;
-			}
-			ext->set_base_template_ast(ParseFile(extname));
+			std::string extname = ResolveBaseTemplate(fname, ext->get_base_template());
+			ext->set_base_template_ast(loader ? loader(extname) : ParseFile(extname));
 		}
 		return ast;
 	}
 
-	ASTPtr Parser::ParseFile(const std::string& fname) {
+	ASTPtr Parser::ParseFile(const std::string& fname, const ASTLoader& loader) {
 		std::ifstream str(fname, std::ios::binary);
 		if(!str) throw std::runtime_error("failed to open file");
-		return ParseStream(str, fname);
+		return ParseStream(str, fname, loader);
+	}
+
+	std::string Parser::ResolveBaseTemplate(const std::string& fname, const std::string& base) {
+		if(startsWith(base, "/")) return base;
+		auto fnameparts = split(fname, "/", false);
+		if(fnameparts.empty()) throw std::runtime_error("invalid template filename");
+		fnameparts.erase(fnameparts.begin() + fnameparts.size() - 1); // Remove filename
+		return join("/", fnameparts) + "/" + base;
 	}
 
 	void Parser::DumpAST(std::ostream& str, ASTPtr ast) {
@@ -502,7 +677,7 @@ namespace cpptemplate {
 			str << "\t" << p->get_name() << " " << p->get_type() << std::endl;
 		str << "Blocks:" << std::endl;
 		for(auto& b : ast->get_blocks()) {
-			str << "\t" << b->get_name() << std::endl;
+			str << "\t" << b->get_name() << (b->is_parallel() ? " (parallel)" : "") << std::endl;
 			for(auto& n : b->get_nodes())
 				DumpNode(str, n, 1);
 		}
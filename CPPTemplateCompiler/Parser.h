@@ -1,7 +1,11 @@
 #pragma once
 #include "AST.h"
+#include <functional>
 
 namespace cpptemplate {
+	// Resolves the AST of a base template given its path
+	typedef std::function<ASTPtr(const std::string&)> ASTLoader;
+
 	class Parser {
 		struct Token;
 		static std::vector<Token> Tokenize(std::istream& is);
@@ -13,11 +17,15 @@ namespace cpptemplate {
 		static NodePtr BuildNode(std::vector<Token>::const_iterator& it, std::vector<Token>::const_iterator end);
 		static ForEachLoopNodePtr BuildForEachNode(std::vector<Token>::const_iterator& it, std::vector<Token>::const_iterator end);
 		static ConditionNodePtr BuildConditionNode(std::vector<Token>::const_iterator& it, std::vector<Token>::const_iterator end);
+		static StaticNodePtr BuildStaticNode(std::vector<Token>::const_iterator& it, std::vector<Token>::const_iterator end);
+		static void NumberStatics(const std::vector<NodePtr>& nodes, size_t& count);
+		static std::vector<NodePtr> ScopeLets(std::vector<NodePtr> nodes);
 
 		static void DumpNode(std::ostream& str, NodePtr n, size_t indent);
 	public:
-		static ASTPtr ParseStream(std::istream& is, const std::string& fname);
-		static ASTPtr ParseFile(const std::string& fname);
+		static ASTPtr ParseStream(std::istream& is, const std::string& fname, const ASTLoader& loader = nullptr);
+		static ASTPtr ParseFile(const std::string& fname, const ASTLoader& loader = nullptr);
+		static std::string ResolveBaseTemplate(const std::string& fname, const std::string& base);
 
 		static void DumpAST(std::ostream& str, ASTPtr ast);
 	};
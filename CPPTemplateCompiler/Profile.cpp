@@ -0,0 +1,46 @@
+#include "Profile.h"
+#include <fstream>
+#include <sstream>
+
+namespace cpptemplate {
+	std::string Profile::MakeKey(ASTPtr ast, NodePtr node) {
+		return ast->get_classname() + ":" + std::to_string(node->get_source_line()) + ":" + std::to_string(node->get_source_col());
+	}
+
+	ProfilePtr Profile::ParseStream(std::istream& is) {
+		auto ptr = std::make_shared<Profile>();
+		std::string line;
+		size_t cnt_line = 0;
+		while(std::getline(is, line)) {
+			cnt_line++;
+			if(line.empty()) continue;
+			std::istringstream ss(line);
+			std::string key;
+			size_t index;
+			uint64_t count;
+			if(!(ss >> key >> index >> count) || index >= MAX_COUNTERS)
+				throw std::runtime_error("invalid profile entry at line " + std::to_string(cnt_line));
+			// Multiple runs append to the same file, so entries are summed up
+			ptr->add(key, index, count);
+		}
+		return ptr;
+	}
+
+	ProfilePtr Profile::ParseFile(const std::string& fname) {
+		std::ifstream str(fname, std::ios::binary);
+		if(!str) throw std::runtime_error("failed to open profile");
+		return ParseStream(str);
+	}
+
+	void Profile::add(const std::string& key, size_t index, uint64_t count) {
+		auto& c = counters[key];
+		if(c.size() <= index) c.resize(index + 1);
+		c[index] += count;
+	}
+
+	uint64_t Profile::get(const std::string& key, size_t index) const {
+		auto it = counters.find(key);
+		if(it == counters.end() || it->second.size() <= index) return 0;
+		return it->second[index];
+	}
+}
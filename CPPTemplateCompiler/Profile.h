@@ -0,0 +1,27 @@
+#pragma once
+#include "AST.h"
+#include <cstdint>
+#include <map>
+
+namespace cpptemplate {
+	class Profile;
+	typedef std::shared_ptr<Profile> ProfilePtr;
+
+	// Branch and loop counters collected by an instrumented build.
+	// Conditions record one counter per branch followed by the else branch,
+	// loops record the number of entries followed by the number of iterations.
+	class Profile {
+		std::map<std::string, std::vector<uint64_t>> counters {};
+	public:
+		// Counters an instrumented build records per node at most, a profile with higher indices is rejected
+		static const size_t MAX_COUNTERS = 1024;
+
+		static std::string MakeKey(ASTPtr ast, NodePtr node);
+		static ProfilePtr ParseStream(std::istream& is);
+		static ProfilePtr ParseFile(const std::string& fname);
+
+		void add(const std::string& key, size_t index, uint64_t count);
+		bool has(const std::string& key) const { return counters.count(key) != 0; }
+		uint64_t get(const std::string& key, size_t index) const;
+	};
+}
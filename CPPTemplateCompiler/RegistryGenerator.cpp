@@ -0,0 +1,219 @@
+#include "RegistryGenerator.h"
+#include "StringHelper.h"
+#include <algorithm>
+#include <set>
+#include <sstream>
+
+namespace cpptemplate {
+	// Give up on a displacement search after this many tries and retry with twice the slots
+	static const uint32_t REGISTRY_MAX_DISPLACEMENT = 1u << 20;
+
+	uint64_t RegistryGenerator::Hash(const std::string& name)
+	{
+		// FNV-1a, finalized as FNV alone leaves the high bits picking the bucket badly spread for similar names.
+		// The generated lookup computes the same.
+		uint64_t h = 14695981039346656037ull;
+		for(auto c : name) {
+			h ^= static_cast<unsigned char>(c);
+			h *= 1099511628211ull;
+		}
+		return Mix(h, 0);
+	}
+
+	uint64_t RegistryGenerator::Mix(uint64_t hash, uint32_t displacement)
+	{
+		// Murmur3 finalizer, so every displacement gives a fresh spread of the low bits
+		uint64_t x = hash ^ (displacement * 0x9e3779b97f4a7c15ull);
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdull;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ull;
+		x ^= x >> 33;
+		return x;
+	}
+
+	void RegistryGenerator::BuildTables(const std::vector<RegistryEntry>& entries, std::vector<uint32_t>& displacements, std::vector<uint32_t>& slots)
+	{
+		std::vector<uint64_t> hashes;
+		std::set<uint64_t> seen;
+		for(auto& e : entries) {
+			hashes.push_back(Hash(e.name));
+			if(!seen.insert(hashes.back()).second)
+				throw std::runtime_error("duplicate template name " + e.name + " in registry");
+		}
+
+		size_t nslots = 1;
+		while(nslots < entries.size()) nslots <<= 1;
+		while(true) {
+			// Two names per bucket on average, buckets are placed largest first while most slots are free
+			size_t nbuckets = std::max<size_t>(nslots / 2, 1);
+			std::vector<std::vector<size_t>> buckets(nbuckets);
+			for(size_t i = 0; i < hashes.size(); i++)
+				buckets[(hashes[i] >> 32) & (nbuckets - 1)].push_back(i);
+			std::vector<size_t> order(nbuckets);
+			for(size_t i = 0; i < nbuckets; i++) order[i] = i;
+			std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+
+			displacements.assign(nbuckets, 0);
+			slots.assign(nslots, 0);
+			bool placed = true;
+			for(auto b : order) {
+				if(buckets[b].empty()) break;
+				uint32_t d = 0;
+				std::vector<size_t> taken;
+				for(; d < REGISTRY_MAX_DISPLACEMENT; d++) {
+					taken.clear();
+					for(auto i : buckets[b]) {
+						auto s = Mix(hashes[i], d) & (nslots - 1);
+						if(slots[s] != 0 || std::find(taken.begin(), taken.end(), s) != taken.end()) break;
+						taken.push_back(s);
+					}
+					if(taken.size() == buckets[b].size()) break;
+				}
+				if(d == REGISTRY_MAX_DISPLACEMENT) {
+					placed = false;
+					break;
+				}
+				displacements[b] = d;
+				for(size_t i = 0; i < taken.size(); i++)
+					slots[taken[i]] = buckets[b][i] + 1;
+			}
+			if(placed) return;
+			nslots <<= 1;
+		}
+	}
+
+	std::string RegistryGenerator::GenerateHeader(const std::string& classname)
+	{
+		return R"(#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <typeinfo>
+
+class )" + classname + R"(
+{
+	public:
+		struct entry
+		{
+			std::string_view name;
+			// Singleton of the template class, constructed on first use
+			const void* (*instance)();
+			const std::type_info* type;
+			void (*render)(const void* instance, std::string& out, const std::type_info& type, void* p);
+		};
+
+		// Entry of a template, nullptr if no template of that name was compiled into the registry
+		static const entry* find(std::string_view name);
+
+		// Shared instance of a template if it is of class T
+		template<typename T>
+		static const T* get(std::string_view name) {
+			auto e = find(name);
+			if(!e || *e->type != typeid(T)) return nullptr;
+			return static_cast<const T*>(e->instance());
+		}
+
+		// Appends the template to out, p has to be the params of the template. Returns false for unknown names.
+		template<typename P>
+		static bool render_by_name(std::string_view name, std::string& out, P& p) {
+			auto e = find(name);
+			if(!e) return false;
+			e->render(e->instance(), out, typeid(p), dynamic_cast<void*>(&p));
+			return true;
+		}
+	private:
+		static const entry entries[];
+		static const uint32_t displacements[];
+		static const uint32_t slots[];
+		template<typename T> static const void* instance_of();
+		template<typename T> static void render_as(const void* instance, std::string& out, const std::type_info& type, void* p);
+};
+)";
+	}
+
+	std::string RegistryGenerator::GenerateImplementation(const std::string& classname, const std::vector<RegistryEntry>& entries)
+	{
+		std::vector<uint32_t> displacements, slots;
+		BuildTables(entries, displacements, slots);
+
+		auto quote = [](const std::string& str) {
+			std::string res = "\"";
+			for(auto c : str) {
+				if(c == '"' || c == '\\') res += '\\';
+				res += c;
+			}
+			return res + "\"";
+		};
+		auto qualified = [](ASTPtr ast) {
+			std::string res;
+			for(auto& ns : split(ast->get_namespace(), "::"))
+				res += "::" + ns;
+			return res + "::" + ast->get_classname();
+		};
+
+		std::ostringstream impl;
+		impl << "#include \"" << classname << ".h\"" << std::endl;
+		for(auto& e : entries)
+			impl << "#include \"" << e.header << "\"" << std::endl;
+		impl << "#include <stdexcept>" << std::endl;
+		impl << std::endl;
+		impl << "template<typename T>" << std::endl;
+		impl << "const void* " << classname << R"(::instance_of()
+{
+	// Initialized once even if several threads get here first, init and deinit run like for any other instance
+	static const T instance;
+	return &instance;
+}
+
+template<typename T>
+void )" << classname << R"(::render_as(const void* instance, std::string& out, const std::type_info& type, void* p)
+{
+	if(type != typeid(typename T::params)) throw std::invalid_argument("invalid param struct");
+	static_cast<const T*>(instance)->render(out, *static_cast<typename T::params*>(p));
+}
+
+)";
+		impl << "const " << classname << "::entry " << classname << "::entries[] = {" << std::endl;
+		for(auto& e : entries) {
+			auto cls = qualified(e.ast);
+			impl << "\t{ " << quote(e.name) << ", &instance_of<" << cls << ">, &typeid(" << cls << "), &render_as<" << cls << "> }," << std::endl;
+		}
+		impl << "};" << std::endl;
+		impl << std::endl;
+		impl << "const uint32_t " << classname << "::displacements[] = {";
+		for(size_t i = 0; i < displacements.size(); i++)
+			impl << (i % 16 == 0 ? "\n\t" : " ") << displacements[i] << ",";
+		impl << std::endl << "};" << std::endl;
+		impl << std::endl;
+		// Index into entries plus one, zero for free slots
+		impl << "const uint32_t " << classname << "::slots[] = {";
+		for(size_t i = 0; i < slots.size(); i++)
+			impl << (i % 16 == 0 ? "\n\t" : " ") << slots[i] << ",";
+		impl << std::endl << "};" << std::endl;
+		impl << std::endl;
+		impl << "const " << classname << "::entry* " << classname << R"(::find(std::string_view name)
+{
+	auto mix = [](uint64_t x) {
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdull;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ull;
+		x ^= x >> 33;
+		return x;
+	};
+	uint64_t h = 14695981039346656037ull;
+	for(auto c : name) {
+		h ^= static_cast<unsigned char>(c);
+		h *= 1099511628211ull;
+	}
+	h = mix(h);
+	auto x = mix(h ^ (displacements[(h >> 32) & )" << displacements.size() - 1 << R"(] * 0x9e3779b97f4a7c15ull));
+	auto slot = slots[x & )" << slots.size() - 1 << R"(];
+	if(slot == 0 || entries[slot - 1].name != name) return nullptr;
+	return &entries[slot - 1];
+}
+)";
+		return impl.str();
+	}
+}
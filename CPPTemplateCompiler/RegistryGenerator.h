@@ -0,0 +1,26 @@
+#pragma once
+#include "AST.h"
+#include <cstdint>
+
+namespace cpptemplate {
+	// A template made available by name, header is the path of its generated header as included by the registry
+	struct RegistryEntry {
+		std::string name;
+		std::string header;
+		ASTPtr ast;
+	};
+
+	// Emits a class mapping template names to singleton instances of their generated classes.
+	// Names are looked up through a perfect hash with one displacement per bucket, so a lookup
+	// hashes the name once, reads two constant tables and compares a single candidate.
+	// Instances are constructed on first use and only handed out as const, which makes the
+	// registry safe to use from any number of threads without locking.
+	class RegistryGenerator {
+		static uint64_t Hash(const std::string& name);
+		static uint64_t Mix(uint64_t hash, uint32_t displacement);
+		static void BuildTables(const std::vector<RegistryEntry>& entries, std::vector<uint32_t>& displacements, std::vector<uint32_t>& slots);
+	public:
+		static std::string GenerateHeader(const std::string& classname);
+		static std::string GenerateImplementation(const std::string& classname, const std::vector<RegistryEntry>& entries);
+	};
+}
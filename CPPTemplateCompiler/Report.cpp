@@ -0,0 +1,218 @@
+#include "Report.h"
+#include "StringHelper.h"
+#include <algorithm>
+#include <cstdio>
+#include <ostream>
+#include <sstream>
+
+namespace cpptemplate {
+	// Capacity of an empty std::string before it allocates, libstdc++ and libc++ alike
+	static const size_t REPORT_SSO_CAPACITY = 15;
+
+	void Report::AddCost(const std::vector<NodePtr>& nodes, ASTPtr ast, ASTPtr level, const GeneratorOptions& options, size_t depth, Cost& cost)
+	{
+		auto base_of = [](ASTPtr l) { return l->is_base_ast() ? nullptr : std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast(); };
+		// Anything but a plain name or member may build a temporary string
+		auto temporary = [](const std::string& code) { return code.find_first_of("(+\"'[?") != std::string::npos; };
+		for(auto& onode : nodes) {
+			auto node = Generator::ReplaceMacros(onode, level);
+			switch(node->get_type()) {
+				case NodeType::AppendString: {
+					auto& data = std::dynamic_pointer_cast<AppendStringNode>(node)->get_data();
+					cost.static_bytes += data.size();
+					if(!data.empty()) cost.appends++;
+					break;
+				}
+				case NodeType::Expression: {
+					cost.dynamic_expressions++;
+					cost.appends++;
+					if(temporary(std::dynamic_pointer_cast<ExpressionNode>(node)->get_code())) cost.allocations++;
+					break;
+				}
+				case NodeType::Translation:
+					cost.appends++;
+					if(!options.catalogs.empty())
+						cost.static_bytes += options.catalogs.front()->get(std::dynamic_pointer_cast<TranslationNode>(node)->get_key()).size();
+					break;
+				case NodeType::ForEachLoop: {
+					auto l = std::dynamic_pointer_cast<ForEachLoopNode>(node);
+					cost.loop_depth = std::max(cost.loop_depth, depth + 1);
+					// Chunk buffers and their list
+					if(l->is_parallel()) cost.allocations += 2;
+					AddCost(l->get_nodes(), ast, level, options, depth + 1, cost);
+					break;
+				}
+				case NodeType::Conditional: {
+					// Every branch counts, the report is an upper bound
+					auto cn = std::dynamic_pointer_cast<ConditionNode>(node);
+					for(auto& b : cn->get_branches())
+						AddCost(b.second, ast, level, options, depth, cost);
+					AddCost(cn->get_else_branch(), ast, level, options, depth, cost);
+					break;
+				}
+				case NodeType::Let: {
+					auto l = std::dynamic_pointer_cast<LetNode>(node);
+					if(temporary(l->get_code())) cost.allocations++;
+					AddCost(l->get_nodes(), ast, level, options, depth, cost);
+					break;
+				}
+				case NodeType::Static:
+					// Rendered ahead of time, a render only appends the stored text
+					cost.appends++;
+					break;
+				case NodeType::BlockCall:
+				case NodeType::BlockParentCall: {
+					cost.block_calls++;
+					// Resolved like the virtual call, a parent call continues below the calling template
+					std::string name;
+					ASTPtr l;
+					if(node->get_type() == NodeType::BlockCall) {
+						name = std::dynamic_pointer_cast<BlockCallNode>(node)->get_block();
+						l = ast;
+					} else {
+						name = std::dynamic_pointer_cast<BlockParentCallNode>(node)->get_block();
+						l = base_of(level);
+					}
+					while(l && !l->get_block(name)) l = base_of(l);
+					if(!l) break;
+					// Blocks the base declares parallel render into a buffer of their own, parent calls render in place
+					auto root = l;
+					while(base_of(root)) root = base_of(root);
+					if(node->get_type() == NodeType::BlockCall && root->get_block(name) && root->get_block(name)->is_parallel()) cost.allocations++;
+					AddCost(l->get_block(name)->get_nodes(), ast, l, options, depth, cost);
+					break;
+				}
+			}
+		}
+	}
+
+	size_t Report::GrowthAllocations(size_t bytes)
+	{
+		// The output doubles its capacity whenever it is full
+		size_t res = 0;
+		for(size_t capacity = REPORT_SSO_CAPACITY; capacity < bytes; capacity *= 2) res++;
+		return res;
+	}
+
+	size_t Report::FunctionBytes(const std::string& code, const std::string& name)
+	{
+		// Definitions start at the beginning of a line and end with a brace of their own
+		size_t res = 0;
+		size_t pos = 0;
+		while((pos = code.find("\nvoid " + name + "(", pos)) != std::string::npos) {
+			auto end = code.find("\n}\n", pos);
+			if(end == std::string::npos) end = code.size();
+			else end += 3;
+			res += end - pos - 1;
+			pos = end - 1;
+		}
+		return res;
+	}
+
+	std::string Report::Quote(const std::string& str)
+	{
+		std::string res = "\"";
+		for(auto c : str) {
+			switch(c) {
+				case '"': res += "\\\""; break;
+				case '\\': res += "\\\\"; break;
+				case '\n': res += "\\n"; break;
+				case '\r': res += "\\r"; break;
+				case '\t': res += "\\t"; break;
+				default:
+					if(static_cast<unsigned char>(c) < 0x20) {
+						char buf[8];
+						snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned>(static_cast<unsigned char>(c)));
+						res += buf;
+					} else {
+						res += c;
+					}
+			}
+		}
+		return res + "\"";
+	}
+
+	void Report::WriteCost(std::ostream& str, const Cost& cost, const std::string& indent)
+	{
+		str << indent << "\"static_bytes\": " << cost.static_bytes << "," << std::endl;
+		str << indent << "\"dynamic_expressions\": " << cost.dynamic_expressions << "," << std::endl;
+		str << indent << "\"appends\": " << cost.appends << "," << std::endl;
+		str << indent << "\"estimated_allocations\": " << cost.allocations + GrowthAllocations(cost.static_bytes) << "," << std::endl;
+		str << indent << "\"block_calls\": " << cost.block_calls << "," << std::endl;
+		str << indent << "\"loop_depth\": " << cost.loop_depth << "," << std::endl;
+	}
+
+	void Report::WriteReport(std::ostream& str, const std::vector<ASTPtr>& asts, const GeneratorOptions& options)
+	{
+		auto qualified = [](ASTPtr ast) {
+			return ast->get_namespace().empty() ? ast->get_classname() : ast->get_namespace() + "::" + ast->get_classname();
+		};
+		str << "{" << std::endl;
+		str << "\t\"templates\": [" << std::endl;
+		for(size_t i = 0; i < asts.size(); i++) {
+			auto ast = asts[i];
+			// Extends chain from the template itself down to the base template
+			std::vector<ASTPtr> chain;
+			for(ASTPtr l = ast; l; l = l->is_base_ast() ? nullptr : std::dynamic_pointer_cast<ExtendingTemplateAST>(l)->get_base_template_ast())
+				chain.push_back(l);
+			auto header = Generator::GenerateHeader(ast, options);
+			auto impl = Generator::GenerateImplementation(ast, options);
+
+			Cost cost;
+			auto root = std::dynamic_pointer_cast<BaseTemplateAST>(chain.back());
+			AddCost(root->get_nodes(), ast, root, options, 0, cost);
+
+			str << "\t\t{" << std::endl;
+			str << "\t\t\t\"template\": " << Quote(ast->get_filename()) << "," << std::endl;
+			str << "\t\t\t\"class\": " << Quote(qualified(ast)) << "," << std::endl;
+			str << "\t\t\t\"extends\": [";
+			for(size_t l = 1; l < chain.size(); l++)
+				str << (l == 1 ? "" : ", ") << Quote(qualified(chain[l]));
+			str << "]," << std::endl;
+			// Templates a virtual block call may have to look through
+			str << "\t\t\t\"dispatch_depth\": " << chain.size() << "," << std::endl;
+			str << "\t\t\t\"header_bytes\": " << header.size() << "," << std::endl;
+			str << "\t\t\t\"implementation_bytes\": " << impl.size() << "," << std::endl;
+			WriteCost(str, cost, "\t\t\t");
+
+			// Blocks as the template renders them, the most derived definition wins
+			std::vector<std::string> names;
+			for(auto it = chain.rbegin(); it != chain.rend(); ++it)
+				for(auto& b : (*it)->get_blocks())
+					if(std::find(names.begin(), names.end(), b->get_name()) == names.end())
+						names.push_back(b->get_name());
+			str << "\t\t\t\"blocks\": [" << std::endl;
+			for(size_t b = 0; b < names.size(); b++) {
+				auto& name = names[b];
+				size_t definitions = 0;
+				ASTPtr defined;
+				for(auto& l : chain) {
+					if(!l->get_block(name)) continue;
+					definitions++;
+					if(!defined) defined = l;
+				}
+				Cost block_cost;
+				AddCost(defined->get_block(name)->get_nodes(), ast, defined, options, 0, block_cost);
+				// Only blocks of this template are generated into its implementation
+				size_t code_bytes = 0;
+				if(defined == ast) {
+					code_bytes += FunctionBytes(impl, ast->get_classname() + "::renderBlock_" + name);
+					for(auto& c : options.catalogs)
+						code_bytes += FunctionBytes(impl, ast->get_classname() + "::renderBlock_" + name + "_" + c->get_identifier());
+				}
+				str << "\t\t\t\t{" << std::endl;
+				str << "\t\t\t\t\t\"name\": " << Quote(name) << "," << std::endl;
+				str << "\t\t\t\t\t\"defined_in\": " << Quote(qualified(defined)) << "," << std::endl;
+				str << "\t\t\t\t\t\"definitions\": " << definitions << "," << std::endl;
+				str << "\t\t\t\t\t\"parallel\": " << (chain.back()->get_block(name) && chain.back()->get_block(name)->is_parallel() ? "true" : "false") << "," << std::endl;
+				WriteCost(str, block_cost, "\t\t\t\t\t");
+				str << "\t\t\t\t\t\"code_bytes\": " << code_bytes << std::endl;
+				str << "\t\t\t\t}" << (b + 1 < names.size() ? "," : "") << std::endl;
+			}
+			str << "\t\t\t]" << std::endl;
+			str << "\t\t}" << (i + 1 < asts.size() ? "," : "") << std::endl;
+		}
+		str << "\t]" << std::endl;
+		str << "}" << std::endl;
+	}
+}
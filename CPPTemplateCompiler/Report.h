@@ -0,0 +1,30 @@
+#pragma once
+#include "AST.h"
+#include "Generator.h"
+#include <iosfwd>
+
+namespace cpptemplate {
+	// Estimates what rendering a template costs, as JSON for tooling to compare between changes.
+	// Figures count a single pass over the template: loop bodies are counted once with
+	// loop_depth telling how deep they nest, and every branch of a condition counts.
+	// The size of dynamic output depends on the params, so expressions are counted instead of bytes.
+	class Report {
+		struct Cost {
+			size_t static_bytes = 0;
+			size_t dynamic_expressions = 0;
+			size_t appends = 0;
+			// Temporaries of expressions, growth of the output and buffers of parallel parts
+			size_t allocations = 0;
+			size_t block_calls = 0;
+			size_t loop_depth = 0;
+		};
+
+		static void AddCost(const std::vector<NodePtr>& nodes, ASTPtr ast, ASTPtr level, const GeneratorOptions& options, size_t depth, Cost& cost);
+		static size_t GrowthAllocations(size_t bytes);
+		static size_t FunctionBytes(const std::string& code, const std::string& name);
+		static void WriteCost(std::ostream& str, const Cost& cost, const std::string& indent);
+		static std::string Quote(const std::string& str);
+	public:
+		static void WriteReport(std::ostream& str, const std::vector<ASTPtr>& asts, const GeneratorOptions& options);
+	};
+}
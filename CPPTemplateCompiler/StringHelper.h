@@ -77,4 +77,29 @@ static inline std::string join(const std::string& delim, const std::vector<std::
 		res += parts[i];
 	}
 	return res;
-}
\ No newline at end of file
+}
+
+// length of the longest prefix of s that is valid UTF-8
+static inline size_t valid_utf8_prefix(const std::string& s)
+{
+	size_t i = 0;
+	while (i < s.size()) {
+		auto c = static_cast<unsigned char>(s[i]);
+		size_t len;
+		unsigned char lo = 0x80, hi = 0xbf;
+		if (c < 0x80) { i++; continue; }
+		else if (c >= 0xc2 && c <= 0xdf) len = 2;
+		else if (c >= 0xe0 && c <= 0xef) { len = 3; if (c == 0xe0) lo = 0xa0; else if (c == 0xed) hi = 0x9f; }
+		else if (c >= 0xf0 && c <= 0xf4) { len = 4; if (c == 0xf0) lo = 0x90; else if (c == 0xf4) hi = 0x8f; }
+		else return i;
+		for (size_t j = 1; j < len; j++) {
+			if (i + j >= s.size()) return i;
+			auto n = static_cast<unsigned char>(s[i + j]);
+			if (n < lo || n > hi) return i;
+			lo = 0x80;
+			hi = 0xbf;
+		}
+		i += len;
+	}
+	return s.size();
+}
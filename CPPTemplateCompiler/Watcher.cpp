@@ -0,0 +1,232 @@
+#include "Watcher.h"
+#include "Parser.h"
+#include "StringHelper.h"
+#include <cerrno>
+#include <chrono>
+#include <iostream>
+#ifdef __linux__
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace cpptemplate {
+	// Wait this long for further events before regenerating, editors often touch several files at once
+	static const int WATCH_SETTLE_MS = 5;
+
+	Watcher::Watcher(std::string dir, GenerateCallback cb, PrepareCallback prep)
+		: directory(Normalize(dir)), generate(std::move(cb)), prepare(std::move(prep))
+	{}
+
+	Watcher::~Watcher() {
+#ifdef __linux__
+		if(inotify_fd >= 0) close(inotify_fd);
+#endif
+	}
+
+	std::string Watcher::Normalize(const std::string& path) {
+		std::vector<std::string> res;
+		for(auto& p : split(path, "/")) {
+			if(p == ".") continue;
+			if(p == ".." && !res.empty() && res.back() != "..") res.pop_back();
+			else res.push_back(p);
+		}
+		auto str = join("/", res);
+		if(startsWith(path, "/")) return "/" + str;
+		return str.empty() ? "." : str;
+	}
+
+	bool Watcher::IsTemplate(const std::string& path) {
+		static const std::string ext = ".tmpl";
+		return path.size() > ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+	}
+
+	ASTPtr Watcher::load(const std::string& path) {
+		auto it = asts.find(path);
+		if(it != asts.end()) return it->second;
+		// Base templates are served from memory if we already know them
+		auto ast = Parser::ParseFile(path, [this](const std::string& base) { return load(Normalize(base)); });
+		if(prepare) prepare(ast);
+		asts[path] = ast;
+		link(path);
+		return ast;
+	}
+
+	bool Watcher::reload(const std::string& path) {
+		ASTPtr old;
+		auto it = asts.find(path);
+		if(it != asts.end()) {
+			old = it->second;
+			unlink(path);
+			asts.erase(it);
+		}
+		try {
+			load(path);
+			return true;
+		} catch(const std::exception& e) {
+			std::cerr << path << ": " << e.what() << std::endl;
+			// Keep serving the last good version to dependents
+			if(old) {
+				asts[path] = old;
+				link(path);
+			}
+			return false;
+		}
+	}
+
+	void Watcher::forget(const std::string& path) {
+		if(asts.count(path) == 0) return;
+		unlink(path);
+		asts.erase(path);
+	}
+
+	void Watcher::link(const std::string& path) {
+		auto ast = asts.at(path);
+		if(ast->is_base_ast()) return;
+		auto ext = std::dynamic_pointer_cast<ExtendingTemplateAST>(ast);
+		dependents[Normalize(Parser::ResolveBaseTemplate(path, ext->get_base_template()))].insert(path);
+	}
+
+	void Watcher::unlink(const std::string& path) {
+		auto ast = asts.at(path);
+		if(ast->is_base_ast()) return;
+		auto ext = std::dynamic_pointer_cast<ExtendingTemplateAST>(ast);
+		auto base = Normalize(Parser::ResolveBaseTemplate(path, ext->get_base_template()));
+		dependents[base].erase(path);
+		if(dependents[base].empty()) dependents.erase(base);
+	}
+
+	void Watcher::collect_dependents(const std::string& path, std::set<std::string>& res) const {
+		auto it = dependents.find(path);
+		if(it == dependents.end()) return;
+		for(auto& d : it->second) {
+			if(res.insert(d).second)
+				collect_dependents(d, res);
+		}
+	}
+
+	void Watcher::regenerate(const std::set<std::string>& changed) {
+		std::set<std::string> todo;
+		for(auto& path : changed) {
+#ifdef __linux__
+			bool exists = access(path.c_str(), F_OK) == 0;
+#else
+			bool exists = true;
+#endif
+			if(!exists) {
+				forget(path);
+				if(dependents.count(path))
+					std::cerr << path << ": removed, but still extended by other templates" << std::endl;
+				continue;
+			}
+			if(reload(path)) todo.insert(path);
+		}
+		// Point templates extending a reloaded one at the new AST, their own AST stays valid
+		for(auto& path : todo) {
+			auto it = dependents.find(path);
+			if(it == dependents.end()) continue;
+			for(auto& d : it->second)
+				std::dynamic_pointer_cast<ExtendingTemplateAST>(asts.at(d))->set_base_template_ast(asts.at(path));
+		}
+		std::set<std::string> affected = todo;
+		for(auto& path : todo)
+			collect_dependents(path, affected);
+
+		for(auto& path : affected) {
+			auto start = std::chrono::steady_clock::now();
+			try {
+				generate(asts.at(path));
+			} catch(const std::exception& e) {
+				std::cerr << path << ": " << e.what() << std::endl;
+				continue;
+			}
+			auto ms = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / 1000.0;
+			std::cout << "Generated " << path << " (" << ms << " ms)" << std::endl;
+		}
+	}
+
+#ifdef __linux__
+	void Watcher::add_watch(const std::string& dir) {
+		int wd = inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+		if(wd < 0) throw std::runtime_error("failed to watch " + dir);
+		watches[wd] = dir;
+	}
+
+	void Watcher::scan(const std::string& dir, std::set<std::string>& found) {
+		add_watch(dir);
+		DIR* d = opendir(dir.c_str());
+		if(!d) throw std::runtime_error("failed to open directory " + dir);
+		while(auto e = readdir(d)) {
+			std::string name = e->d_name;
+			if(name == "." || name == "..") continue;
+			auto path = Normalize(dir + "/" + name);
+			struct stat st;
+			if(stat(path.c_str(), &st) != 0) continue;
+			if(S_ISDIR(st.st_mode)) scan(path, found);
+			else if(IsTemplate(path)) found.insert(path);
+		}
+		closedir(d);
+	}
+
+	void Watcher::run() {
+		inotify_fd = inotify_init1(IN_CLOEXEC);
+		if(inotify_fd < 0) throw std::runtime_error("failed to initialize inotify");
+
+		std::set<std::string> found;
+		scan(directory, found);
+		for(auto& path : found) {
+			try {
+				load(path);
+			} catch(const std::exception& e) {
+				std::cerr << path << ": " << e.what() << std::endl;
+			}
+		}
+		for(auto& e : asts) {
+			try {
+				generate(e.second);
+			} catch(const std::exception& ex) {
+				std::cerr << e.first << ": " << ex.what() << std::endl;
+			}
+		}
+		std::cout << "Watching " << directory << " (" << asts.size() << " templates)" << std::endl;
+
+		alignas(struct inotify_event) char buf[64 * 1024];
+		while(true) {
+			std::set<std::string> changed;
+			int timeout = -1;
+			while(true) {
+				pollfd pfd { inotify_fd, POLLIN, 0 };
+				int res = poll(&pfd, 1, timeout);
+				if(res < 0 && errno == EINTR) continue;
+				if(res < 0) throw std::runtime_error("failed to wait for file changes");
+				if(res == 0) break;
+				auto len = read(inotify_fd, buf, sizeof(buf));
+				if(len < 0 && errno == EINTR) continue;
+				if(len < 0) throw std::runtime_error("failed to read file changes");
+				for(char* ptr = buf; ptr < buf + len;) {
+					auto ev = reinterpret_cast<const struct inotify_event*>(ptr);
+					ptr += sizeof(struct inotify_event) + ev->len;
+					auto it = watches.find(ev->wd);
+					if(it == watches.end() || ev->len == 0) continue;
+					auto path = Normalize(it->second + "/" + ev->name);
+					if(ev->mask & IN_ISDIR) {
+						if(ev->mask & (IN_CREATE | IN_MOVED_TO)) scan(path, changed);
+					} else if(IsTemplate(path) && (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE))) {
+						changed.insert(path);
+					}
+				}
+				timeout = WATCH_SETTLE_MS;
+			}
+			regenerate(changed);
+		}
+	}
+#else
+	void Watcher::add_watch(const std::string&) {}
+	void Watcher::scan(const std::string&, std::set<std::string>&) {}
+	void Watcher::run() {
+		throw std::runtime_error("watch mode is only supported on linux");
+	}
+#endif
+}
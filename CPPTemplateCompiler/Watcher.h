@@ -0,0 +1,48 @@
+#pragma once
+#include "AST.h"
+#include <functional>
+#include <map>
+#include <set>
+
+namespace cpptemplate {
+	// Keeps every template below a directory parsed in memory and regenerates
+	// a template together with everything extending it whenever it changes.
+	class Watcher {
+	public:
+		typedef std::function<void(ASTPtr)> GenerateCallback;
+		typedef std::function<void(ASTPtr)> PrepareCallback;
+	private:
+		std::string directory;
+		GenerateCallback generate;
+		// Applied once to every template when it is parsed, dependents share the result
+		PrepareCallback prepare;
+		// Parsed templates by normalized path
+		std::map<std::string, ASTPtr> asts {};
+		// Normalized path of a base template to the templates directly extending it
+		std::map<std::string, std::set<std::string>> dependents {};
+		// inotify watch descriptors to the directory they watch
+		std::map<int, std::string> watches {};
+		int inotify_fd = -1;
+
+		static std::string Normalize(const std::string& path);
+		static bool IsTemplate(const std::string& path);
+
+		ASTPtr load(const std::string& path);
+		bool reload(const std::string& path);
+		void forget(const std::string& path);
+		void link(const std::string& path);
+		void unlink(const std::string& path);
+		void collect_dependents(const std::string& path, std::set<std::string>& res) const;
+		void regenerate(const std::set<std::string>& changed);
+		void add_watch(const std::string& dir);
+		void scan(const std::string& dir, std::set<std::string>& found);
+	public:
+		Watcher(std::string dir, GenerateCallback cb, PrepareCallback prep = nullptr);
+		Watcher(const Watcher&) = delete;
+		Watcher& operator=(const Watcher&) = delete;
+		~Watcher();
+
+		// Generates all templates once, then blocks and regenerates on changes
+		void run();
+	};
+}
@@ -1,8 +1,16 @@
+#include "ASTCache.h"
+#include "BytecodeGenerator.h"
 #include "Generator.h"
+#include "Minifier.h"
 #include "Parser.h"
+#include "RegistryGenerator.h"
+#include "Report.h"
 #include "StringHelper.h"
+#include "Watcher.h"
 #include <iostream>
 #include <fstream>
+#include <set>
+#include <sstream>
 #ifdef WITH_FS
 #include <filesystem>
 namespace fs = std::filesystem;
@@ -12,14 +20,44 @@ namespace fs = std::experimental::filesystem;
 #endif
 
 struct cmd_options {
-	std::string template_filename {};
+	std::vector<std::string> template_filenames {};
+	// Output file for a single template, output directory if several are given
 	std::string output_filename {};
+	std::string registry_filename {};
+	std::string unity_filename {};
+	std::string pch_filename {};
+	std::string profile_filename {};
+	std::string cache_directory {};
+	std::string watch_directory {};
+	// <locale>:<file> pairs in the order given
+	std::vector<std::pair<std::string, std::string>> catalogs {};
+	size_t split_budget = 0;
+	size_t blob_threshold = 0;
 	bool dump_only = false;
 	bool print_help = false;
+	bool instrument = false;
+	bool bytecode = false;
+	bool json = false;
+	bool minify = false;
+	bool deflate = false;
+	bool hash = false;
+	bool lean_header = false;
+	bool prerender = false;
+	bool atomic_variables = false;
+	std::string utf8 {};
+	bool line_directives = false;
+	bool batch = false;
+	bool report = false;
+	bool precompress = false;
 
 };
 static std::string ParseCommandLine(int argc, const char** const argv, cmd_options& options);
 static void PrintHelp();
+static std::string DefaultOutputFilename(cpptemplate::ASTPtr ast, const std::string& template_filename);
+static std::string RelativePath(const std::string& dir, const std::string& path);
+static void CollectSystemIncludes(const std::string& code, std::set<std::string>& res);
+static void MinifyTemplate(cpptemplate::ASTPtr ast);
+static bool WriteOutput(cpptemplate::ASTPtr ast, std::string output_filename, const std::string& template_filename, const cpptemplate::GeneratorOptions& gen_options, const cmd_options& options, std::set<std::string>* system_includes = nullptr);
 
 int main(int argc, const char** const argv) try {
 	cmd_options options;
@@ -32,39 +70,258 @@ int main(int argc, const char** const argv) try {
 		PrintHelp();
 		return 0;
 	}
-	auto ast = cpptemplate::Parser::ParseFile(options.template_filename);
-	if(options.dump_only) {
-		cpptemplate::Parser::DumpAST(std::cout, ast);
-	} else {
-		if(options.output_filename.empty()) {
-			auto parts = split(options.template_filename, "/");
-			parts.erase(parts.begin() + parts.size() -1);
-			parts.push_back(ast->get_classname());
-			options.output_filename = join("/", parts);
+	cpptemplate::GeneratorOptions gen_options;
+	gen_options.instrument = options.instrument;
+	gen_options.json = options.json;
+	gen_options.deflate = options.deflate;
+	gen_options.hash = options.hash;
+	gen_options.lean_header = options.lean_header;
+	gen_options.prerender = options.prerender;
+	gen_options.atomic_variables = options.atomic_variables;
+	gen_options.utf8 = options.utf8;
+	gen_options.batch = options.batch;
+	gen_options.split_budget = options.split_budget;
+	gen_options.blob_threshold = options.blob_threshold;
+	for(auto& c : options.catalogs)
+		gen_options.catalogs.push_back(cpptemplate::Catalog::ParseFile(c.second, c.first));
+	if(!options.profile_filename.empty())
+		gen_options.profile = cpptemplate::Profile::ParseFile(options.profile_filename);
+
+	if(!options.watch_directory.empty()) {
+		// In watch mode -o names the output directory, files are named after their class
+		// Templates are minified once when they are parsed, bases are shared by everything extending them
+		cpptemplate::Watcher::PrepareCallback prepare;
+		if(options.minify) prepare = cpptemplate::Minifier::MinifyAST;
+		cpptemplate::Watcher watcher(options.watch_directory, [&](cpptemplate::ASTPtr ast) {
+			std::string output;
+			if(!options.output_filename.empty()) output = options.output_filename + "/" + ast->get_classname();
+			if(!WriteOutput(ast, output, ast->get_filename(), gen_options, options))
+				throw std::runtime_error("Could not open output files");
+		}, prepare);
+		watcher.run();
+		return 0;
+	}
+
+	std::vector<cpptemplate::RegistryEntry> registry;
+	std::vector<std::string> implementations;
+	std::set<std::string> system_includes;
+	std::vector<cpptemplate::ASTPtr> reported;
+	for(auto& template_filename : options.template_filenames) {
+		cpptemplate::ASTPtr ast;
+		if(options.cache_directory.empty()) {
+			ast = cpptemplate::Parser::ParseFile(template_filename);
+		} else {
+			fs::create_directories(options.cache_directory);
+			ast = cpptemplate::ASTCache::ParseFile(template_filename, options.cache_directory);
+		}
+		if(options.dump_only) {
+			cpptemplate::Parser::DumpAST(std::cout, ast);
+			continue;
+		}
+		if(options.minify)
+			MinifyTemplate(ast);
+		if(options.report) {
+			reported.push_back(ast);
+			continue;
+		}
+		std::string output;
+		if(options.template_filenames.size() == 1) output = options.output_filename;
+		else if(!options.output_filename.empty()) output = options.output_filename + "/" + ast->get_classname();
+		if(output.empty())
+			output = DefaultOutputFilename(ast, template_filename);
+		if(!WriteOutput(ast, output, template_filename, gen_options, options, &system_includes)) {
+			std::cerr << "Could not open output files" << std::endl;
+			return -2;
+		}
+		implementations.push_back(output + ".cpp");
+		if(options.bytecode) implementations.push_back(output + "_vm.cpp");
+		if(options.registry_filename.empty()) continue;
+		// Templates are registered by their path without extension
+		auto name = template_filename;
+		if(startsWith(name, "./")) name = name.substr(2);
+		if(name.size() > 5 && name.compare(name.size() - 5, 5, ".tmpl") == 0) name.resize(name.size() - 5);
+		auto registry_dir = options.registry_filename.substr(0, options.registry_filename.find_last_of('/') + 1);
+		registry.push_back({ name, RelativePath(registry_dir, output + (options.lean_header ? "_params.h" : ".h")), ast });
+	}
+
+	if(options.report && !options.dump_only) {
+		cpptemplate::Report::WriteReport(std::cout, reported, gen_options);
+		return 0;
+	}
+
+	if(!options.registry_filename.empty() && !options.dump_only) {
+		auto classname = options.registry_filename.substr(options.registry_filename.find_last_of('/') + 1);
+		auto dir = options.registry_filename.substr(0, options.registry_filename.find_last_of('/') + 1);
+		if(!dir.empty())
+			fs::create_directories(dir);
+		std::ofstream header(options.registry_filename + ".h", std::ios::binary);
+		std::ofstream impl(options.registry_filename + ".cpp", std::ios::binary);
+		if(!header || !impl) {
+			std::cerr << "Could not open output files" << std::endl;
+			return -2;
 		}
+		header << cpptemplate::RegistryGenerator::GenerateHeader(classname);
+		impl << cpptemplate::RegistryGenerator::GenerateImplementation(classname, registry);
+		implementations.push_back(options.registry_filename + ".cpp");
+	}
 
-		auto dir = options.output_filename;
-		dir = dir.substr(0, dir.find_last_of('/'));
-		if(!dir.empty()) {
+	if(!options.unity_filename.empty() && !options.dump_only) {
+		// A single translation unit for all generated code, nothing in it has internal linkage that could clash
+		auto dir = options.unity_filename.substr(0, options.unity_filename.find_last_of('/') + 1);
+		if(!dir.empty())
 			fs::create_directories(dir);
+		std::ofstream unity(options.unity_filename + ".cpp", std::ios::binary);
+		if(!unity) {
+			std::cerr << "Could not open output files" << std::endl;
+			return -2;
 		}
-		
-		std::ofstream header(options.output_filename + ".h", std::ios::binary);
-		std::ofstream impl(options.output_filename + ".cpp", std::ios::binary);
-		if(!header || !impl) {
+		for(auto& f : implementations)
+			unity << "#include \"" << RelativePath(dir, f) << "\"" << std::endl;
+	}
+
+	if(!options.pch_filename.empty() && !options.dump_only) {
+		// Library headers the generated code includes, stable enough to be precompiled
+		auto dir = options.pch_filename.substr(0, options.pch_filename.find_last_of('/') + 1);
+		if(!dir.empty())
+			fs::create_directories(dir);
+		std::ofstream pch(options.pch_filename + ".h", std::ios::binary);
+		if(!pch) {
 			std::cerr << "Could not open output files" << std::endl;
 			return -2;
 		}
-		header << cpptemplate::Generator::GenerateHeader(ast);
-		impl << cpptemplate::Generator::GenerateImplementation(ast);
-		header.close();
-		impl.close();
+		pch << "#pragma once" << std::endl;
+		for(auto& incl : system_includes)
+			pch << "#include " << incl << std::endl;
 	}
 } catch(const std::exception& e) {
 	std::cerr << "Error during execution: " << e.what() << std::endl;
 	return -1;
 }
 
+static std::string DefaultOutputFilename(cpptemplate::ASTPtr ast, const std::string& template_filename) {
+	auto parts = split(template_filename, "/");
+	parts.erase(parts.begin() + parts.size() -1);
+	parts.push_back(ast->get_classname());
+	return join("/", parts);
+}
+
+static std::string RelativePath(const std::string& dir, const std::string& path) {
+	// Both are relative to the working directory or both are absolute
+	if(startsWith(dir, "/") != startsWith(path, "/")) return path;
+	std::vector<std::string> from, to;
+	for(auto& p : split(dir, "/")) if(p != ".") from.push_back(p);
+	for(auto& p : split(path, "/")) if(p != ".") to.push_back(p);
+	size_t common = 0;
+	while(common < from.size() && common + 1 < to.size() && from[common] == to[common]) common++;
+	std::vector<std::string> res(from.size() - common, "..");
+	res.insert(res.end(), to.begin() + common, to.end());
+	return join("/", res);
+}
+
+static void MinifyTemplate(cpptemplate::ASTPtr ast) {
+	// The interpreter renders the whole extends chain, so minify all of it
+	for(auto l = ast; l; l = l->is_base_ast() ? nullptr : std::dynamic_pointer_cast<cpptemplate::ExtendingTemplateAST>(l)->get_base_template_ast())
+		cpptemplate::Minifier::MinifyAST(l);
+}
+
+static void CollectSystemIncludes(const std::string& code, std::set<std::string>& res) {
+	// Conditional includes are left out, they depend on the target
+	int depth = 0;
+	std::istringstream iss(code);
+	std::string line;
+	while(std::getline(iss, line)) {
+		if(startsWith(line, "#if")) depth++;
+		else if(startsWith(line, "#endif")) depth--;
+		else if(depth == 0 && startsWith(line, "#include") && startsWith(trim_copy(line.substr(8)), "<")) res.insert(trim_copy(line.substr(8)));
+	}
+}
+
+static bool WriteOutput(cpptemplate::ASTPtr ast, std::string output_filename, const std::string& template_filename, const cpptemplate::GeneratorOptions& gen_options, const cmd_options& options, std::set<std::string>* system_includes) {
+	if(output_filename.empty())
+		output_filename = DefaultOutputFilename(ast, template_filename);
+
+	auto dir = output_filename;
+	dir = dir.substr(0, dir.find_last_of('/'));
+	if(!dir.empty()) {
+		fs::create_directories(dir);
+	}
+
+	std::ofstream header(output_filename + ".h", std::ios::binary);
+	std::ofstream impl(output_filename + ".cpp", std::ios::binary);
+	if(!header || !impl)
+		return false;
+
+	auto generator_options = gen_options;
+	if(options.line_directives)
+		generator_options.line_directives = output_filename + ".cpp";
+	if(gen_options.blob_threshold > 0) {
+		generator_options.blob = std::make_shared<std::string>();
+		generator_options.blob_name = fs::path(output_filename + ".blob").filename().string();
+	}
+	auto header_code = cpptemplate::Generator::GenerateHeader(ast, gen_options);
+	header << header_code;
+	header.close();
+	if(system_includes) {
+		// Includes are collected from the code, so keep it in memory
+		auto impl_code = cpptemplate::Generator::GenerateImplementation(ast, generator_options);
+		impl << impl_code;
+		CollectSystemIncludes(header_code, *system_includes);
+		CollectSystemIncludes(impl_code, *system_includes);
+	} else {
+		cpptemplate::Generator::GenerateImplementation(impl, ast, generator_options);
+	}
+	impl.close();
+	if(generator_options.blob && !generator_options.blob->empty()) {
+		std::ofstream blob(output_filename + ".blob", std::ios::binary);
+		if(!blob)
+			return false;
+		blob << *generator_options.blob;
+	}
+
+	std::string text;
+	if(gen_options.prerender && cpptemplate::Generator::Prerender(ast, text)) {
+		// Served as a file as it is, or precompressed for clients accepting gzip
+		std::ofstream html(output_filename + ".html", std::ios::binary);
+		if(!html)
+			return false;
+		html << text;
+		if(options.precompress) {
+			std::ofstream gz(output_filename + ".html.gz", std::ios::binary);
+			if(!gz)
+				return false;
+			gz << cpptemplate::Generator::CompressGzip(text);
+		}
+	}
+
+	if(gen_options.lean_header) {
+		auto params_code = cpptemplate::Generator::GenerateParamsHeader(ast);
+		std::ofstream params(output_filename + "_params.h", std::ios::binary);
+		if(!params)
+			return false;
+		params << params_code;
+		if(system_includes)
+			CollectSystemIncludes(params_code, *system_includes);
+	}
+
+	if(options.bytecode) {
+		std::ofstream code(output_filename + ".tbc", std::ios::binary);
+		std::ofstream vm_header(output_filename + "_vm.h", std::ios::binary);
+		std::ofstream vm_impl(output_filename + "_vm.cpp", std::ios::binary);
+		if(!code || !vm_header || !vm_impl)
+			return false;
+		code << cpptemplate::BytecodeGenerator::GenerateBytecode(ast);
+		auto vm_header_code = cpptemplate::BytecodeGenerator::GenerateHeader(ast);
+		auto vm_impl_code = cpptemplate::BytecodeGenerator::GenerateImplementation(ast, gen_options);
+		vm_header << vm_header_code;
+		vm_impl << vm_impl_code;
+		if(system_includes) {
+			CollectSystemIncludes(vm_header_code, *system_includes);
+			CollectSystemIncludes(vm_impl_code, *system_includes);
+		}
+	}
+	return true;
+}
+
 static std::string ParseCommandLine(int argc, const char** const argv, cmd_options& options) {
 	using namespace std::string_literals;
 	for(int i=1; i<argc; i++) {
@@ -73,21 +330,126 @@ static std::string ParseCommandLine(int argc, const char** const argv, cmd_optio
 			options.output_filename = argv[++i];
 		} else if(argv[i] == "-d"s) {
 			options.dump_only = true;
+		} else if(argv[i] == "--cache"s) {
+			if(i == argc-1) return "Missing value after --cache";
+			options.cache_directory = argv[++i];
+		} else if(argv[i] == "--watch"s) {
+			if(i == argc-1) return "Missing value after --watch";
+			options.watch_directory = argv[++i];
+		} else if(argv[i] == "--instrument"s) {
+			options.instrument = true;
+		} else if(argv[i] == "--profile"s) {
+			if(i == argc-1) return "Missing value after --profile";
+			options.profile_filename = argv[++i];
+		} else if(argv[i] == "--catalog"s) {
+			if(i == argc-1) return "Missing value after --catalog";
+			std::string arg = argv[++i];
+			auto pos = arg.find(':');
+			if(pos == std::string::npos || pos == 0 || pos == arg.size() - 1) return "Expected <locale>:<file> after --catalog";
+			auto locale = arg.substr(0, pos);
+			for(auto& c : options.catalogs)
+				if(c.first == locale) return "Duplicate catalog for locale " + locale;
+			options.catalogs.emplace_back(locale, arg.substr(pos + 1));
+		} else if(argv[i] == "--minify"s) {
+			options.minify = true;
+		} else if(argv[i] == "--deflate"s) {
+			options.deflate = true;
+		} else if(argv[i] == "--hash"s) {
+			options.hash = true;
+		} else if(argv[i] == "--json"s) {
+			options.json = true;
+		} else if(argv[i] == "--bytecode"s) {
+			options.bytecode = true;
+		} else if(argv[i] == "--registry"s) {
+			if(i == argc-1) return "Missing value after --registry";
+			options.registry_filename = argv[++i];
+		} else if(argv[i] == "--split-budget"s) {
+			if(i == argc-1) return "Missing value after --split-budget";
+			try {
+				options.split_budget = std::stoul(argv[++i]);
+			} catch(const std::exception&) {
+				return "Expected a number after --split-budget";
+			}
+		} else if(argv[i] == "--blob"s) {
+			if(i == argc-1) return "Missing value after --blob";
+			try {
+				options.blob_threshold = std::stoul(argv[++i]);
+			} catch(const std::exception&) {
+				return "Expected a number after --blob";
+			}
+		} else if(argv[i] == "--lean"s) {
+			options.lean_header = true;
+		} else if(argv[i] == "--atomic-variables"s) {
+			options.atomic_variables = true;
+		} else if(argv[i] == "--line-directives"s) {
+			options.line_directives = true;
+		} else if(argv[i] == "--utf8"s) {
+			if(i == argc-1) return "Missing value after --utf8";
+			options.utf8 = argv[++i];
+			if(options.utf8 != "check" && options.utf8 != "replace") return "Expected check or replace after --utf8";
+		} else if(argv[i] == "--batch"s) {
+			options.batch = true;
+		} else if(argv[i] == "--report"s) {
+			options.report = true;
+		} else if(argv[i] == "--prerender"s) {
+			options.prerender = true;
+		} else if(argv[i] == "--precompress"s) {
+			options.precompress = true;
+		} else if(argv[i] == "--unity"s) {
+			if(i == argc-1) return "Missing value after --unity";
+			options.unity_filename = argv[++i];
+		} else if(argv[i] == "--pch"s) {
+			if(i == argc-1) return "Missing value after --pch";
+			options.pch_filename = argv[++i];
 		} else if(argv[i] == "-h"s || argv[i] == "--help"s) {
 			options.print_help = true;
 		} else {
-			if(!options.template_filename.empty()) return "Can only process one file per invocation";
-			options.template_filename = argv[i];
+			options.template_filenames.push_back(argv[i]);
 		}
 	}
-	if(options.template_filename.empty() && !options.print_help)
+	if(!options.watch_directory.empty()) {
+		if(!options.template_filenames.empty()) return "Can not watch a directory and process a file at the same time";
+		if(options.dump_only) return "Can not dump the AST in watch mode";
+		if(options.report) return "Can not report in watch mode";
+		if(!options.registry_filename.empty()) return "Can not write a registry in watch mode";
+		if(!options.unity_filename.empty() || !options.pch_filename.empty()) return "Can not write a unity file or header list in watch mode";
+	} else if(options.template_filenames.empty() && !options.print_help)
 		return "Missing template filename";
+	if(options.instrument && !options.profile_filename.empty())
+		return "Can not instrument and apply a profile at the same time";
+	if(options.precompress && !options.prerender)
+		return "--precompress requires --prerender";
 	return "";
 }
 
 static void PrintHelp() {
-	std::cout << "cpptemplate <infile> [options]" << std::endl;
-	std::cout << "\t-o <outfile>     Set output filename" << std::endl;
+	std::cout << "cpptemplate <infile>... [options]" << std::endl;
+	std::cout << "cpptemplate --watch <dir> [options]" << std::endl;
+	std::cout << "\t-o <outfile>     Set output filename, the output directory if several templates are given" << std::endl;
 	std::cout << "\t-d               Just dump AST" << std::endl;
+	std::cout << "\t--report         Just print the estimated render cost of each template and block as JSON" << std::endl;
+	std::cout << "\t--cache <dir>    Reuse parsed templates stored in <dir>" << std::endl;
+	std::cout << "\t--watch <dir>    Regenerate *.tmpl below <dir> and their dependents on change, -o sets the output directory" << std::endl;
+	std::cout << "\t--instrument     Count branch and loop hits, written to $CPPTEMPLATE_PROFILE on exit" << std::endl;
+	std::cout << "\t--profile <file> Optimize branches and loops using a profile of an instrumented build" << std::endl;
+	std::cout << "\t--catalog <locale>:<file> Resolve {% trans key %} from <file>, repeat for every locale" << std::endl;
+	std::cout << "\t--minify         Strip HTML comments and collapse whitespace in the template text" << std::endl;
+	std::cout << "\t--deflate        Generate render_deflate writing gzip with static text compressed at compile time, needs zlib" << std::endl;
+	std::cout << "\t--hash           Generate render_hashed and render_hash returning a CRC32C of the output, e.g. for ETags" << std::endl;
+	std::cout << "\t--json           Generate a streaming from_json(std::string_view, params&) for the template parameters" << std::endl;
+	std::cout << "\t--bytecode       Also write <outfile>.tbc and an interpreter binding <outfile>_vm.h/.cpp" << std::endl;
+	std::cout << "\t--registry <file> Write <file>.h/.cpp looking up the given templates by path without extension" << std::endl;
+	std::cout << "\t--split-budget <n> Move runs of statements into functions of their own once a render function exceeds <n> statements" << std::endl;
+	std::cout << "\t--blob <n>       Store static text of at least <n> bytes in <outfile>.blob, embedded with #embed or .incbin" << std::endl;
+	std::cout << "\t                 .incbin looks it up in the include path of the assembler, e.g. -I<outdir>" << std::endl;
+	std::cout << "\t--lean           Define params in <outfile>_params.h, the class header then only needs the standard library" << std::endl;
+	std::cout << "\t--prerender      Write <outfile>.html and static_render() for templates with the same output for any params" << std::endl;
+	std::cout << "\t--precompress    Also write <outfile>.html.gz for prerendered templates" << std::endl;
+	std::cout << "\t--atomic-variables Keep variables in a snapshot swapped atomically, setters may run while other threads render" << std::endl;
+	std::cout << "\t--line-directives Map generated statements back to template lines with #line, e.g. for profilers and debuggers" << std::endl;
+	std::cout << "\t--utf8 <mode>     Validate expression output as UTF-8, check throws on invalid input and replace substitutes U+FFFD" << std::endl;
+	std::cout << "\t--batch          Generate render_batch writing the output of many params into one string with an offset table" << std::endl;
+	std::cout << "\t--unity <file>   Write <file>.cpp including all generated implementations" << std::endl;
+	std::cout << "\t--pch <file>     Write <file>.h including the library headers used by the generated code, to be precompiled" << std::endl;
 	std::cout << "\t-h               Print help" << std::endl;
 }
\ No newline at end of file